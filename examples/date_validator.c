@@ -36,6 +36,19 @@ int map_chr(const void *chr) {
     return char_map[(int)*(char *)chr];
 }
 
+struct match_list {
+    size_t count;
+    size_t start[16];
+    size_t end[16];
+};
+
+int record_match(size_t start, size_t end, void *ctx) {
+    struct match_list *matches = ctx;
+    matches->start[matches->count] = start;
+    matches->end[matches->count] = end;
+    return ++matches->count == 16;
+}
+
 int main(void)
 {
    /*****************************************************
@@ -698,5 +711,218 @@ int main(void)
         assert(GET_STATE(machine) == tests[i].expected_result);
     }
 
+    enum field { YEAR, MONTH, DAY };
+
+    // Captures of each field, filled in while the date is validated
+    static const struct tag_table tags = {
+        .tags = {
+
+            [FIRST_DIGIT] = {
+                [_1] = TAG_START(YEAR),
+                [_2] = TAG_START(YEAR),
+            },
+
+            [FOURTH_DIGIT] = {
+                [_0] = TAG_END(YEAR), [_1] = TAG_END(YEAR), [_2] = TAG_END(YEAR), [_3] = TAG_END(YEAR), [_4] = TAG_END(YEAR),
+                [_5] = TAG_END(YEAR), [_6] = TAG_END(YEAR), [_7] = TAG_END(YEAR), [_8] = TAG_END(YEAR), [_9] = TAG_END(YEAR),
+            },
+
+            [FIRST_DIGIT_OF_MONTH] = {
+                [_0] = TAG_START(MONTH),
+                [_1] = TAG_START(MONTH),
+            },
+
+            [SECOND_DIGIT_JAN_TO_SEP] = {
+                [_0] = TAG_END(MONTH), [_1] = TAG_END(MONTH), [_2] = TAG_END(MONTH), [_3] = TAG_END(MONTH), [_4] = TAG_END(MONTH),
+                [_5] = TAG_END(MONTH), [_6] = TAG_END(MONTH), [_7] = TAG_END(MONTH), [_8] = TAG_END(MONTH), [_9] = TAG_END(MONTH),
+            },
+
+            [SECOND_DIGIT_OCT_TO_DEC] = {
+                [_0] = TAG_END(MONTH), [_1] = TAG_END(MONTH), [_2] = TAG_END(MONTH), [_3] = TAG_END(MONTH), [_4] = TAG_END(MONTH),
+                [_5] = TAG_END(MONTH), [_6] = TAG_END(MONTH), [_7] = TAG_END(MONTH), [_8] = TAG_END(MONTH), [_9] = TAG_END(MONTH),
+            },
+
+            [FIRST_DIGIT_OF_DAY] = {
+                [_0] = TAG_START(DAY),
+                [_1] = TAG_START(DAY),
+                [_2] = TAG_START(DAY),
+                [_3] = TAG_START(DAY),
+            },
+
+            [SECOND_DIGIT_ZERO] = {
+                [_1] = TAG_END(DAY), [_2] = TAG_END(DAY), [_3] = TAG_END(DAY), [_4] = TAG_END(DAY), [_5] = TAG_END(DAY),
+                [_6] = TAG_END(DAY), [_7] = TAG_END(DAY), [_8] = TAG_END(DAY), [_9] = TAG_END(DAY),
+            },
+
+            [SECOND_DIGIT_ONE_TWO] = {
+                [_0] = TAG_END(DAY), [_1] = TAG_END(DAY), [_2] = TAG_END(DAY), [_3] = TAG_END(DAY), [_4] = TAG_END(DAY),
+                [_5] = TAG_END(DAY), [_6] = TAG_END(DAY), [_7] = TAG_END(DAY), [_8] = TAG_END(DAY), [_9] = TAG_END(DAY),
+            },
+
+            [SECOND_DIGIT_THREE] = {
+                [_0] = TAG_END(DAY),
+                [_1] = TAG_END(DAY),
+            },
+
+        }
+    };
+
+    struct capture_case {
+        char input[16];
+        char year[8];
+        char month[8];
+        char day[8];
+    };
+
+    struct capture_case captures[] = {
+        { "2000-01-31", "2000", "01", "31" },
+        { "1987-06-05", "1987", "06", "05" },
+        { "2021-12-09", "2021", "12", "09" },
+        { "1999-10-20", "1999", "10", "20" },
+    };
+
+    for (int i = 0; i < (int)(sizeof(captures) / sizeof(*captures)); i++) {
+        size_t registers[MAX_TAGS];
+        char fields[3][8];
+        printf("Capturing fields of '%s'\n", captures[i].input);
+        SET_STATE(machine, FIRST_DIGIT);
+        assert(stately_run_tagged(&machine, &tags, captures[i].input, 1, strlen(captures[i].input), registers) == ACCEPT);
+        for (int f = YEAR; f <= DAY; f++) {
+            size_t start = registers[2 * f], end = registers[2 * f + 1];
+            memcpy(fields[f], captures[i].input + start, end - start);
+            fields[f][end - start] = '\0';
+        }
+        printf("    year %s, month %s, day %s\n", fields[YEAR], fields[MONTH], fields[DAY]);
+        assert(!strcmp(fields[YEAR], captures[i].year));
+        assert(!strcmp(fields[MONTH], captures[i].month));
+        assert(!strcmp(fields[DAY], captures[i].day));
+    }
+
+    struct byte_classifier classifier;
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        SET_STATE(machine, FIRST_DIGIT);
+        (void)stately_run_bytes(&machine, &classifier, tests[i].input, strlen(tests[i].input));
+        assert(GET_STATE(machine) == tests[i].expected_result);
+    }
+
+    // Bytes >= 128 would index char_map[] out of bounds, but classify fine
+    for (int c = 128; c < 256; c++) {
+        char input[64] = "2000-01-01";
+        input[c % 10] = (char)c;
+        SET_STATE(machine, FIRST_DIGIT);
+        assert(stately_run_bytes(&machine, &classifier, input, strlen(input)) == TRAP);
+    }
+
+    {
+        puts("Searching log for dates");
+        const char log[] =
+            "2021-03-04 12:00:01 INFO service started\n"
+            "1999-21-01 12:00:02 WARN clock skew, next sync 2000-02-29\n"
+            "12000-01-01 ERROR rollover; 2000-1-01; 3000-01-01; 1987-06-05\n"
+            "tail 2000-12-3";
+        const size_t expected[][2] = { { 0, 10 }, { 88, 98 }, { 100, 110 }, { 150, 160 } };
+        struct compiled_machine compiled;
+        struct match_list matches = { 0 };
+
+        SET_STATE(machine, FIRST_DIGIT);
+        assert(stately_compile(&compiled, &machine, &classifier) == 0);
+        stately_accept(&compiled, ACCEPT);
+        assert(compiled.first.count == 1 && compiled.first.lo[0] == '1' && compiled.first.hi[0] == '2');
+
+        (void)stately_search(&compiled, log, strlen(log), record_match, &matches);
+        assert(matches.count == sizeof(expected) / sizeof(*expected));
+        for (size_t i = 0; i < matches.count; i++) {
+            printf("    Found '%.*s' at %zu\n", (int)(matches.end[i] - matches.start[i]), log + matches.start[i], matches.start[i]);
+            assert(matches.start[i] == expected[i][0] && matches.end[i] == expected[i][1]);
+        }
+
+        puts("Searching log for dates with the reversed machine");
+        static struct reverse_search rs;
+        assert(stately_reverse_search_init(&rs, &compiled) == 0);
+
+        // Tagged scans pick the fields out of each match
+        size_t registers[MAX_TAGS];
+        assert(stately_scan_tagged(&compiled, &tags, FIRST_DIGIT, log + 150, 10, registers) == ACCEPT);
+        assert(registers[2 * YEAR] == 0 && registers[2 * YEAR + 1] == 4);
+        assert(registers[2 * MONTH] == 5 && registers[2 * MONTH + 1] == 7);
+        assert(registers[2 * DAY] == 8 && registers[2 * DAY + 1] == 10);
+        memset(&matches, 0, sizeof(matches));
+        (void)stately_search_reverse(&rs, log, strlen(log), record_match, &matches);
+        assert(matches.count == sizeof(expected) / sizeof(*expected));
+        for (size_t i = 0; i < matches.count; i++) {
+            assert(matches.start[i] == expected[i][0] && matches.end[i] == expected[i][1]);
+        }
+
+        puts("Searching log for dates in pieces");
+        for (size_t width = 1; width <= 17; width++) {
+            struct iovec pieces[2 * sizeof(log)];
+            int count = 0;
+            for (size_t at = 0; at < strlen(log); at += width) {
+                pieces[count].iov_base = (char *)log + at;
+                pieces[count++].iov_len = strlen(log) - at < width ? strlen(log) - at : width;
+
+                // Empty buffers in the chain are fine too
+                pieces[count].iov_base = NULL;
+                pieces[count++].iov_len = 0;
+            }
+
+            memset(&matches, 0, sizeof(matches));
+            (void)stately_search_iov(&compiled, pieces, count, record_match, &matches);
+            assert(matches.count == sizeof(expected) / sizeof(*expected));
+            for (size_t i = 0; i < matches.count; i++) {
+                assert(matches.start[i] == expected[i][0] && matches.end[i] == expected[i][1]);
+            }
+
+        }
+
+        char year[] = "2000", dash[] = "-", month_day[] = "02-29";
+        struct iovec date[] = { { year, 4 }, { dash, 1 }, { month_day, 5 } };
+        SET_STATE(machine, FIRST_DIGIT);
+        assert(stately_run_iov(&machine, &classifier, date, 3) == ACCEPT);
+        assert(stately_scan_iov(&compiled, FIRST_DIGIT, date, 2) == FIRST_DIGIT_OF_MONTH);
+
+        puts("Searching log for dates and warnings with Shift-And");
+        struct shift_and sa;
+        stately_shift_and_init(&sa);
+        assert(stately_shift_and_add(&sa, &compiled) == 0);
+        printf("    %d patterns in %d bits\n", sa.patterns, sa.bits);
+        for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+            assert(stately_shift_and_run(&sa, tests[i].input, strlen(tests[i].input)) == (tests[i].expected_result == ACCEPT));
+        }
+
+        // Any other pattern can share the word, as long as it fits
+        assert(stately_shift_and_add_string(&sa, "WARN") == 0);
+        assert(sa.bits == 64 && stately_shift_and_add_string(&sa, "E") == -1);
+        const size_t expected_too[][2] = { { 0, 10 }, { 61, 65 }, { 88, 98 }, { 100, 110 }, { 150, 160 } };
+
+        memset(&matches, 0, sizeof(matches));
+        (void)stately_shift_and_search(&sa, log, strlen(log), record_match, &matches);
+        assert(matches.count == sizeof(expected_too) / sizeof(*expected_too));
+        for (size_t i = 0; i < matches.count; i++) {
+            printf("    Found '%.*s' at %zu\n", (int)(matches.end[i] - matches.start[i]), log + matches.start[i], matches.start[i]);
+            assert(matches.start[i] == expected_too[i][0] && matches.end[i] == expected_too[i][1]);
+        }
+
+        puts("Saving and loading the compiled machine");
+        static unsigned char saved[16384];
+        static struct state_machine loaded_table;
+        struct compiled_machine loaded;
+        size_t size = stately_save(&compiled, saved, 0);
+        printf("    %zu bytes\n", size);
+        assert(size <= sizeof(saved) && stately_save(&compiled, saved, sizeof(saved)) == size);
+        assert(stately_load(&loaded, &loaded_table, saved, size) == 0);
+        assert(loaded.start == FIRST_DIGIT && loaded.accepting[ACCEPT]);
+        for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+            assert(stately_scan(&loaded, FIRST_DIGIT, tests[i].input, strlen(tests[i].input)) == tests[i].expected_result);
+        }
+        memset(&matches, 0, sizeof(matches));
+        assert(stately_search(&loaded, log, strlen(log), record_match, &matches) == sizeof(expected) / sizeof(*expected));
+        assert(stately_load(&loaded, &loaded_table, saved, size - 1) == -1);
+        saved[0] = 'X';
+        assert(stately_load(&loaded, &loaded_table, saved, size) == -1);
+    }
+
     return 0;
 }
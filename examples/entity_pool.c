@@ -0,0 +1,211 @@
+#define STATELY_THREADS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { NOTHING, SEE_PLAYER, LOSE_PLAYER, IN_RANGE, OUT_OF_RANGE, LOW_HEALTH };
+enum state { TRAP, PATROL, CHASE, ATTACK, FLEE };
+
+int map_event(const void *event) {
+    return *(const int *)event;
+}
+
+enum { ENTITIES = 100003, TICKS = 20 };
+
+static int states[ENTITIES];
+static int expected[ENTITIES];
+static int symbols[ENTITIES];
+static int before[ENTITIES];
+static int scratch[ENTITIES];
+
+struct tally {
+    size_t behaved[FLEE + 1];
+    size_t entered[FLEE + 1];
+    size_t exited[FLEE + 1];
+};
+
+void count_behavior(int state, const int *entities, size_t count, void *ctx) {
+    struct tally *tally = ctx;
+    for (size_t i = 0; i < count; i++) {
+        assert(states[entities[i]] == state);
+        assert(i == 0 || entities[i - 1] < entities[i]);
+    }
+    tally->behaved[state] += count;
+}
+
+void count_enter(int state, const int *entities, size_t count, void *ctx) {
+    struct tally *tally = ctx;
+    for (size_t i = 0; i < count; i++) {
+        assert(states[entities[i]] == state && before[entities[i]] != state);
+    }
+    tally->entered[state] += count;
+}
+
+void count_exit(int state, const int *entities, size_t count, void *ctx) {
+    struct tally *tally = ctx;
+    for (size_t i = 0; i < count; i++) {
+        assert(before[entities[i]] == state && states[entities[i]] != state);
+    }
+    tally->exited[state] += count;
+}
+
+int main(void)
+{
+   /***********************************************************
+    * Guard AI shared by every entity in the pool             *
+    *                                                         *
+    *   PATROL --SEE_PLAYER--> CHASE --IN_RANGE--> ATTACK     *
+    *     /|\                   |  /|\               |        *
+    *      +----LOSE_PLAYER-----+   +--OUT_OF_RANGE--+        *
+    *                                                         *
+    *   LOW_HEALTH from CHASE or ATTACK --> FLEE              *
+    *   LOSE_PLAYER from FLEE --> PATROL                      *
+    **********************************************************/
+
+    static struct state_machine machine = {
+
+        // Start state
+        .curr_state = PATROL,
+
+        // Input mapper
+        .map = map_event,
+
+        // States
+        .state_table = {
+
+            [PATROL] = {
+                [NOTHING]      = PATROL,
+                [SEE_PLAYER]   = CHASE,
+                [LOSE_PLAYER]  = PATROL,
+                [IN_RANGE]     = PATROL,
+                [OUT_OF_RANGE] = PATROL,
+                [LOW_HEALTH]   = PATROL,
+            },
+
+            [CHASE] = {
+                [NOTHING]      = CHASE,
+                [SEE_PLAYER]   = CHASE,
+                [LOSE_PLAYER]  = PATROL,
+                [IN_RANGE]     = ATTACK,
+                [OUT_OF_RANGE] = CHASE,
+                [LOW_HEALTH]   = FLEE,
+            },
+
+            [ATTACK] = {
+                [NOTHING]      = ATTACK,
+                [SEE_PLAYER]   = ATTACK,
+                [LOSE_PLAYER]  = PATROL,
+                [IN_RANGE]     = ATTACK,
+                [OUT_OF_RANGE] = CHASE,
+                [LOW_HEALTH]   = FLEE,
+            },
+
+            [FLEE] = {
+                [NOTHING]      = FLEE,
+                [SEE_PLAYER]   = FLEE,
+                [LOSE_PLAYER]  = PATROL,
+                [IN_RANGE]     = FLEE,
+                [OUT_OF_RANGE] = FLEE,
+                [LOW_HEALTH]   = FLEE,
+            },
+
+        }
+
+    };
+
+    struct state_dispatch dispatch = {
+        .behavior = { [PATROL] = count_behavior, [CHASE] = count_behavior, [ATTACK] = count_behavior, [FLEE] = count_behavior },
+        .on_enter = { [CHASE] = count_enter, [ATTACK] = count_enter, [FLEE] = count_enter },
+        .on_exit  = { [PATROL] = count_exit, [CHASE] = count_exit },
+    };
+
+    struct state_pool pool;
+    struct stately_workers workers;
+    unsigned int seed = 12345;
+
+    stately_pool_init(&pool, &machine, states, ENTITIES);
+    assert(stately_workers_start(&workers, 4) == 0);
+
+    for (int i = 0; i < ENTITIES; i++) {
+        expected[i] = PATROL;
+    }
+
+    for (int tick = 0; tick < TICKS; tick++) {
+        printf("Tick %d\n", tick);
+        for (int i = 0; i < ENTITIES; i++) {
+            seed = seed * 1103515245u + 12345u;
+            symbols[i] = (int)((seed >> 16) % (LOW_HEALTH + 1));
+        }
+
+        // Reference: one GET_NEXT_STATE per entity
+        for (int i = 0; i < ENTITIES; i++) {
+            SET_STATE(machine, expected[i]);
+            expected[i] = GET_NEXT_STATE(machine, &symbols[i]);
+        }
+
+        memcpy(before, states, sizeof(states));
+        if (tick % 2) {
+            stately_step_all_parallel(&pool, symbols, &workers);
+        } else {
+            stately_step_all(&pool, symbols);
+        }
+        assert(!memcmp(states, expected, sizeof(states)));
+
+        struct tally tally = { { 0 }, { 0 }, { 0 } }, reference = { { 0 }, { 0 }, { 0 } };
+        for (int i = 0; i < ENTITIES; i++) {
+            reference.behaved[states[i]]++;
+            if (before[i] != states[i]) {
+                reference.entered[states[i]] += states[i] != PATROL;
+                reference.exited[before[i]] += before[i] == PATROL || before[i] == CHASE;
+            }
+        }
+        stately_dispatch_changes(&dispatch, before, &pool, scratch, &tally);
+        stately_dispatch(&dispatch, &pool, scratch, &tally);
+        printf("    %zu patrolling, %zu chasing, %zu attacking, %zu fleeing\n",
+            tally.behaved[PATROL], tally.behaved[CHASE], tally.behaved[ATTACK], tally.behaved[FLEE]);
+        assert(!memcmp(&tally, &reference, sizeof(tally)));
+    }
+
+    stately_workers_stop(&workers);
+
+    // Snapshot the pool to a file at 3 bits per entity and read it back
+    size_t size = stately_pool_snapshot(&pool, NULL, 0);
+    printf("Snapshot of %d entities takes %zu bytes\n", ENTITIES, size);
+    assert(size == STATELY_SNAPSHOT_HEADER + (ENTITIES * 3 + 7) / 8);
+
+    unsigned char *snapshot = malloc(size), *loaded = malloc(size);
+    FILE *file = tmpfile();
+    assert(snapshot && loaded && file);
+    assert(stately_pool_snapshot(&pool, snapshot, size) == size);
+    assert(fwrite(snapshot, 1, size, file) == size);
+    rewind(file);
+    assert(fread(loaded, 1, size, file) == size);
+    fclose(file);
+
+    memset(states, 0, sizeof(states));
+    assert(stately_pool_restore(&pool, loaded, size) == 0);
+    assert(!memcmp(states, expected, sizeof(states)));
+
+    // Damaged or truncated snapshots, and other machines, are refused
+    loaded[size / 2] ^= 0x10;
+    assert(stately_pool_restore(&pool, loaded, size) == -1);
+    loaded[size / 2] ^= 0x10;
+    assert(stately_pool_restore(&pool, loaded, size - 1) == -1);
+    machine.state_table[FLEE][SEE_PLAYER] = CHASE;
+    assert(stately_pool_restore(&pool, loaded, size) == -1);
+    machine.state_table[FLEE][SEE_PLAYER] = FLEE;
+    struct state_pool fewer = { &machine, states, ENTITIES - 1 };
+    assert(stately_pool_restore(&fewer, loaded, size) == -1);
+    assert(!memcmp(states, expected, sizeof(states)));
+
+    free(snapshot);
+    free(loaded);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, PUSH, TIMEOUT, LOCK, UNLOCK };
+enum state { TRAP, CLOSED, OPEN, LOCKED };
+
+int map_event(const void *event) {
+    return *(const int *)event;
+}
+
+enum { DOORS = 10000, HOLD_OPEN = 3 };
+
+static int states[DOORS];
+
+int main(void)
+{
+   /***************************************************
+    * Automatic doors: pushing a closed door opens it  *
+    * and it closes by itself HOLD_OPEN ticks later.   *
+    * Only closed doors can be locked.                 *
+    *                                                  *
+    *  LOCKED <--LOCK-- CLOSED --PUSH--> OPEN          *
+    *     |              /|\  /|\          |           *
+    *     +----UNLOCK-----+    +--TIMEOUT--+           *
+    **************************************************/
+
+    static struct state_machine machine = {
+
+        // Start state
+        .curr_state = CLOSED,
+
+        // Input mapper
+        .map = map_event,
+
+        // States
+        .state_table = {
+
+            [CLOSED] = {
+                [PUSH]    = OPEN,
+                [TIMEOUT] = CLOSED,
+                [LOCK]    = LOCKED,
+                [UNLOCK]  = CLOSED,
+            },
+
+            [OPEN] = {
+                [PUSH]    = OPEN,
+                [TIMEOUT] = CLOSED,
+                [LOCK]    = OPEN,
+                [UNLOCK]  = OPEN,
+            },
+
+            [LOCKED] = {
+                [PUSH]    = LOCKED,
+                [TIMEOUT] = LOCKED,
+                [LOCK]    = LOCKED,
+                [UNLOCK]  = CLOSED,
+            },
+
+        }
+
+    };
+
+    struct state_pool pool;
+    struct state_scheduler scheduler;
+
+    stately_pool_init(&pool, &machine, states, DOORS);
+    assert(stately_scheduler_init(&scheduler, &pool, 64, 64) == 0);
+
+    puts("Tick 0: nothing happens");
+    assert(stately_tick(&scheduler) == 0);
+
+    puts("Tick 1: doors 7 and 4242 are pushed, door 99 is locked");
+    assert(stately_post(&scheduler, 7, PUSH) == 0);
+    assert(stately_post_delayed(&scheduler, 7, TIMEOUT, HOLD_OPEN) == 0);
+    assert(stately_post(&scheduler, 4242, PUSH) == 0);
+    assert(stately_post_delayed(&scheduler, 4242, TIMEOUT, HOLD_OPEN) == 0);
+    assert(stately_post(&scheduler, 99, LOCK) == 0);
+    assert(stately_tick(&scheduler) == 3);
+    assert(states[7] == OPEN && states[4242] == OPEN && states[99] == LOCKED);
+
+    puts("Tick 2: door 99 is pushed and unlocked in the same tick, then locked again later");
+    assert(stately_post(&scheduler, 99, PUSH) == 0);
+    assert(stately_post(&scheduler, 99, UNLOCK) == 0);
+    assert(stately_post_delayed(&scheduler, 99, LOCK, 9) == 0);
+    assert(stately_tick(&scheduler) == 2);
+    assert(states[99] == CLOSED);
+
+    puts("Tick 3: nothing happens");
+    assert(stately_tick(&scheduler) == 0);
+    assert(states[7] == OPEN && states[4242] == OPEN);
+
+    puts("Tick 4: the doors close by themselves");
+    assert(stately_tick(&scheduler) == 2);
+    assert(states[7] == CLOSED && states[4242] == CLOSED);
+
+    for (int tick = 5; tick < 12; tick++) {
+        printf("Tick %d: door 99 is %s\n", tick, states[99] == LOCKED ? "locked" : "closed");
+        assert(stately_tick(&scheduler) == (tick == 11));
+    }
+    assert(states[99] == LOCKED);
+
+    for (int i = 0; i < DOORS; i++) {
+        assert(states[i] == (i == 99 ? LOCKED : CLOSED));
+    }
+
+    puts("Delayed inputs due on the same tick go in posting order");
+    int inputs[] = { PUSH, TIMEOUT, LOCK, UNLOCK, PUSH, TIMEOUT, LOCK };
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(*inputs)); i++) {
+        assert(stately_post_delayed(&scheduler, 5, inputs[i], 1) == 0);
+    }
+    assert(stately_tick(&scheduler) == 0);
+    assert(stately_tick(&scheduler) == sizeof(inputs) / sizeof(*inputs));
+    assert(states[5] == LOCKED);
+
+    puts("Running out of events");
+    for (int i = 0; i < 64; i++) {
+        assert(stately_post(&scheduler, i, PUSH) == 0);
+    }
+    assert(stately_post(&scheduler, 64, PUSH) == -1);
+    assert(stately_tick(&scheduler) == 64);
+    assert(stately_post(&scheduler, 64, PUSH) == 0);
+
+    stately_scheduler_free(&scheduler);
+
+    puts("Complete");
+
+    return 0;
+}
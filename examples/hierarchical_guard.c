@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, NOISE, SEE_PLAYER, LOSE_PLAYER, TIRED, RESTED, PAUSE, RESUME, KILLED };
+
+enum state {
+    TRAP,
+    ALIVE,          // composite, deep history
+        CALM,       // composite
+            PATROL,
+            IDLE,
+        ALERT,      // composite
+            SEARCH,
+            CHASE,
+    PAUSED,
+    DEAD,
+};
+
+const char *texts[] = {
+    [TRAP] = "TRAP", [PATROL] = "PATROL", [IDLE] = "IDLE", [SEARCH] = "SEARCH",
+    [CHASE] = "CHASE", [PAUSED] = "PAUSED", [DEAD] = "DEAD",
+};
+
+int map_event(const void *event) {
+    return *(const int *)event;
+}
+
+int main(void)
+{
+   /**************************************************************
+    * Guard AI as nested states. ALIVE handles PAUSE and KILLED  *
+    * for every state inside it, CALM and ALERT handle what      *
+    * makes the guard switch between them, and RESUME goes back  *
+    * to whichever leaf was active when the game was paused.     *
+    *                                                            *
+    * +-ALIVE (H*)-------------------------+                     *
+    * | +-CALM------+  NOISE  +-ALERT-----+|  PAUSE   +--------+ *
+    * | | PATROL    | ------> | SEARCH    || -------> | PAUSED | *
+    * | |  TIRED |  |  SEE    |  SEE |    ||          +--------+ *
+    * | |       \|/ | ------> |     \|/   || <-------     |      *
+    * | | IDLE      |  LOSE   | CHASE     ||  RESUME (H*) |      *
+    * | +-----------+ <------ +-----------+|              |      *
+    * +------------------------------------+              |      *
+    *          | KILLED                                   |      *
+    *         \|/                                         |      *
+    *        DEAD <-------------- KILLED -----------------+      *
+    *************************************************************/
+
+    struct hierarchical_machine guard = {
+
+        // Start state (entered through ALIVE -> CALM -> PATROL)
+        .curr_state = ALIVE,
+
+        // Input mapper
+        .map = map_event,
+
+        // Nesting
+        .parent = {
+            [CALM] = ALIVE, [ALERT] = ALIVE,
+            [PATROL] = CALM, [IDLE] = CALM,
+            [SEARCH] = ALERT, [CHASE] = ALERT,
+        },
+
+        .initial = {
+            [ALIVE] = CALM,
+            [CALM]  = PATROL,
+            [ALERT] = SEARCH,
+        },
+
+        .history = {
+            [ALIVE] = DEEP_HISTORY,
+        },
+
+        // States
+        .state_table = {
+
+            [ALIVE] = {
+                [PAUSE]  = PAUSED,
+                [KILLED] = DEAD,
+            },
+
+            [CALM] = {
+                [NOISE]      = ALERT,
+                [SEE_PLAYER] = CHASE,
+            },
+
+            [PATROL] = {
+                [TIRED] = IDLE,
+            },
+
+            [IDLE] = {
+                [RESTED] = PATROL,
+            },
+
+            [ALERT] = {
+                [LOSE_PLAYER] = CALM,
+            },
+
+            [SEARCH] = {
+                [SEE_PLAYER] = CHASE,
+            },
+
+            // Pausing mid-chase is a bug in the caller
+            [CHASE] = {
+                [PAUSE] = EXPLICIT_TRAP,
+            },
+
+            [PAUSED] = {
+                [RESUME] = ALIVE,
+                [KILLED] = DEAD,
+            },
+
+        }
+
+    };
+
+    static struct state_machine machine;
+    int leaf_of[MAX_STATES];
+
+    int states = stately_flatten(&machine, leaf_of, &guard);
+    printf("Flattened into %d states\n", states);
+    assert(states > 0);
+
+    // The first flat state found for each leaf keeps the leaf's number
+    assert(GET_STATE(machine) == PATROL);
+
+    struct test_case {
+        int inputs[8];
+        int expected_result;
+    };
+
+    struct test_case tests[] = {
+        { { TIRED },                                    IDLE   },
+        { { TIRED, RESTED },                            PATROL },
+        { { NOISE },                                    SEARCH },
+        { { TIRED, SEE_PLAYER },                        CHASE  },
+        { { NOISE, LOSE_PLAYER },                       PATROL },
+        { { SEE_PLAYER, LOSE_PLAYER, TIRED },           IDLE   },
+        { { TIRED, PAUSE },                             PAUSED },
+        { { TIRED, PAUSE, RESUME },                     IDLE   },
+        { { NOISE, PAUSE, RESUME },                     SEARCH },
+        { { NOISE, PAUSE, RESUME, SEE_PLAYER },         CHASE  },
+        { { TIRED, PAUSE, RESUME, RESTED, PAUSE },      PAUSED },
+        { { TIRED, PAUSE, RESUME, RESTED, PAUSE, RESUME }, PATROL },
+        { { SEE_PLAYER, PAUSE },                        TRAP   },
+        { { SEE_PLAYER, KILLED },                       DEAD   },
+        { { NOISE, PAUSE, KILLED },                     DEAD   },
+        { { TIRED, RESUME },                            TRAP   },
+        { { KILLED, RESUME },                           TRAP   },
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        SET_STATE(machine, PATROL);
+        printf("Testing case %d:", i);
+        for (int c = 0; c < 8 && tests[i].inputs[c]; c++) {
+            (void)GET_NEXT_STATE(machine, &tests[i].inputs[c]);
+            printf(" %s", texts[leaf_of[GET_STATE(machine)]]);
+        }
+        puts("");
+        assert(leaf_of[GET_STATE(machine)] == tests[i].expected_result);
+    }
+
+    puts("Complete");
+
+    return 0;
+}
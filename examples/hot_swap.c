@@ -0,0 +1,117 @@
+#define STATELY_THREADS
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, DIGIT, LETTER };
+enum state { TRAP, ACCEPT };
+
+int map_chr(const void *chr) {
+    char c = *(const char *)chr;
+    return c >= '0' && c <= '9' ? DIGIT : c >= 'a' && c <= 'z' ? LETTER : INVALID;
+}
+
+enum { READERS = 3, SWAPS = 100 };
+
+// One rule update: even versions only accept digits, odd ones also
+// accept letters
+struct version {
+    int number;
+    int alive;
+    struct state_machine machine;
+    struct compiled_machine compiled;
+};
+
+static struct version versions[SWAPS + 1];
+static struct machine_handle handle;
+static int done;
+
+void retire_version(void *machine, void *ctx) {
+    struct version *version = machine;
+    int *destroyed = ctx;
+
+    // Anyone still scanning with it would notice
+    __atomic_store_n(&version->alive, 0, __ATOMIC_SEQ_CST);
+    (*destroyed)++;
+}
+
+void *scan_forever(void *arg) {
+    int reader = (int)(size_t)arg;
+    const char input[] = "2024abc";
+    unsigned long scans = 0;
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        struct version *version = stately_handle_enter(&handle, reader);
+        int result = stately_scan(&version->compiled, ACCEPT, input, strlen(input));
+        assert(result == (version->number % 2 ? ACCEPT : TRAP));
+        assert(__atomic_load_n(&version->alive, __ATOMIC_SEQ_CST));
+        stately_handle_exit(&handle, reader);
+        scans++;
+    }
+    return (void *)scans;
+}
+
+int main(void)
+{
+   /*********************************************
+    * Validators that get replaced while three  *
+    * threads keep scanning with them.          *
+    *                                           *
+    *               digit (or letter in odd     *
+    *              +----+  versions)            *
+    *              |   \|/                      *
+    *            +--------+                     *
+    *            | ACCEPT |                     *
+    *            +--------+                     *
+    ********************************************/
+
+    struct byte_classifier classifier;
+    int destroyed = 0;
+
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    for (int v = 0; v <= SWAPS; v++) {
+        versions[v].number = v;
+        versions[v].alive = 1;
+        versions[v].machine.curr_state = ACCEPT;
+        versions[v].machine.map = map_chr;
+        versions[v].machine.state_table[ACCEPT][DIGIT] = ACCEPT;
+        versions[v].machine.state_table[ACCEPT][LETTER] = v % 2 ? ACCEPT : TRAP;
+        assert(stately_compile(&versions[v].compiled, &versions[v].machine, &classifier) == 0);
+    }
+
+    assert(stately_handle_init(&handle, &versions[0], retire_version, &destroyed) == 0);
+
+    pthread_t readers[READERS];
+    for (int r = 0; r < READERS; r++) {
+        assert(pthread_create(&readers[r], NULL, scan_forever, (void *)(size_t)r) == 0);
+    }
+
+    for (int v = 1; v <= SWAPS; v++) {
+        stately_handle_swap(&handle, &versions[v]);
+        if (v % 10 == 0) {
+            printf("Deployed version %d, %d destroyed so far\n", v, destroyed);
+            sched_yield();
+        }
+    }
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (int r = 0; r < READERS; r++) {
+        void *scans;
+        pthread_join(readers[r], &scans);
+        printf("Reader %d did %lu scans\n", r, (unsigned long)(size_t)scans);
+    }
+
+    // Nobody is reading any more, so everything old can go
+    assert(stately_handle_reclaim(&handle) == 0);
+    assert(destroyed == SWAPS);
+    assert(versions[SWAPS].alive);
+    stately_handle_destroy(&handle);
+    assert(destroyed == SWAPS + 1);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, LETTER, DIGIT, EQUALS, NEWLINE };
+enum state { TRAP, LINE_START, KEY, VALUE_START, VALUE };
+
+const char char_map[128] = {
+    ['a'] = LETTER, ['b'] = LETTER, ['c'] = LETTER, ['d'] = LETTER, ['e'] = LETTER,
+    ['f'] = LETTER, ['g'] = LETTER, ['h'] = LETTER, ['i'] = LETTER, ['j'] = LETTER,
+    ['k'] = LETTER, ['l'] = LETTER, ['m'] = LETTER, ['n'] = LETTER, ['o'] = LETTER,
+    ['p'] = LETTER, ['q'] = LETTER, ['r'] = LETTER, ['s'] = LETTER, ['t'] = LETTER,
+    ['u'] = LETTER, ['v'] = LETTER, ['w'] = LETTER, ['x'] = LETTER, ['y'] = LETTER,
+    ['z'] = LETTER,
+    ['0'] = DIGIT, ['1'] = DIGIT, ['2'] = DIGIT, ['3'] = DIGIT, ['4'] = DIGIT,
+    ['5'] = DIGIT, ['6'] = DIGIT, ['7'] = DIGIT, ['8'] = DIGIT, ['9'] = DIGIT,
+    ['='] = EQUALS,
+    ['\n'] = NEWLINE,
+};
+
+int map_chr(const void *chr) {
+    return char_map[(int)*(const char *)chr];
+}
+
+enum { LINES = 50000, INTERVAL = 4096 };
+
+static char document[LINES * 16 + 64];
+static char edited[LINES * 16 + 64];
+
+// Replaces `removed` bytes at `offset` with `text`
+size_t edit(size_t len, size_t offset, size_t removed, const char *text) {
+    size_t inserted = strlen(text);
+    memcpy(edited, document, offset);
+    memcpy(edited + offset, text, inserted);
+    memcpy(edited + offset + inserted, document + offset + removed, len - offset - removed);
+    memcpy(document, edited, len - removed + inserted);
+    return len - removed + inserted;
+}
+
+int main(void)
+{
+   /*********************************************************
+    * A config file of `key=value` lines, validated once    *
+    * in full and then again after every small edit.        *
+    *                                                       *
+    *             letter       =              digit         *
+    * LINE_START -------> KEY ---> VALUE_START -----> VALUE *
+    *    /|\             | /|\                     | /|\    *
+    *     |              +--+ letter         digit +--+     *
+    *     |                                         |       *
+    *     +---------------- newline ----------------+       *
+    ********************************************************/
+
+    static struct state_machine machine = {
+
+        // Start state
+        .curr_state = LINE_START,
+
+        // Input mapper
+        .map = map_chr,
+
+        // States
+        .state_table = {
+
+            [LINE_START] = {
+                [LETTER]  = KEY,
+            },
+
+            [KEY] = {
+                [LETTER]  = KEY,
+                [EQUALS]  = VALUE_START,
+            },
+
+            [VALUE_START] = {
+                [DIGIT]   = VALUE,
+            },
+
+            [VALUE] = {
+                [DIGIT]   = VALUE,
+                [NEWLINE] = LINE_START,
+            },
+
+        }
+
+    };
+
+    struct byte_classifier classifier;
+    struct compiled_machine compiled;
+    struct scan_checkpoints checkpoints = { 0 };
+    unsigned int seed = 2024;
+    size_t len = 0;
+
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+
+    for (int i = 0; i < LINES; i++) {
+        len += (size_t)sprintf(document + len, "key%c=%d\n", 'a' + i % 26, i);
+    }
+
+    int state = stately_scan_checkpointed(&checkpoints, INTERVAL, &compiled, LINE_START, document, len);
+    printf("Validated %zu bytes with %zu checkpoints\n", len, checkpoints.count);
+    assert(state == LINE_START);
+
+    struct test_case {
+        size_t near;
+        size_t skip;
+        size_t removed;
+        const char *inserted;
+        int expected_result;
+        int local;
+    };
+
+    // Edits are made `skip` bytes into the first line starting after
+    // `near`, and each one applies to the document left by the one before
+    struct test_case tests[] = {
+        { 100000, 5, 1, "7",        LINE_START, 1 },   // Digit for a digit
+        { 200000, 0, 0, "zz",       LINE_START, 1 },   // Longer key
+        { 300000, 0, 0, "new=1\n",  LINE_START, 1 },   // New line
+        { 300000, 0, 6, "",         LINE_START, 1 },   // And gone again
+        { 0,      0, 0, "first=0\n",LINE_START, 1 },
+        { 500000, 0, 1, "",         LINE_START, 1 },   // Shorter key
+        { 400000, 5, 0, "=",        TRAP,       0 },   // Broken from here to the end
+        { 400000, 5, 1, "",         LINE_START, 0 },   // Fixed, but nothing after it was recorded as valid
+        { 450000, 1, 1, "",         LINE_START, 1 },   // Back to only re-checking the edit
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        size_t offset = tests[i].near ? (size_t)(strchr(document + tests[i].near, '\n') + 1 - document) : 0;
+        offset += tests[i].skip;
+        len = edit(len, offset, tests[i].removed, tests[i].inserted);
+        state = stately_rescan(&checkpoints, &compiled, document, len, offset, tests[i].removed, strlen(tests[i].inserted));
+        printf("Testing case %d: rescanned %zu of %zu bytes\n", i, checkpoints.rescanned, len);
+        assert(state == tests[i].expected_result);
+        assert(state == stately_scan(&compiled, LINE_START, document, len));
+        assert(!tests[i].local || checkpoints.rescanned <= 2 * INTERVAL);
+    }
+
+    puts("Random edits");
+    for (int i = 0; i < 200; i++) {
+        char text[8] = { 0 };
+        seed = seed * 1103515245u + 12345u;
+        size_t offset = (seed >> 8) % len, removed = (seed >> 4) % 4;
+        for (int c = 0; c < (int)(seed % 4); c++) {
+            seed = seed * 1103515245u + 12345u;
+            text[c] = "ab=1\n"[(seed >> 16) % 5];
+        }
+        if (offset + removed > len) {
+            removed = len - offset;
+        }
+        len = edit(len, offset, removed, text);
+        state = stately_rescan(&checkpoints, &compiled, document, len, offset, removed, strlen(text));
+        assert(state == stately_scan(&compiled, LINE_START, document, len));
+        for (size_t c = 0; c < checkpoints.count; c += 17) {
+            assert(checkpoints.states[c] == stately_scan(&compiled, LINE_START, document, checkpoints.offsets[c]));
+        }
+    }
+
+    stately_checkpoints_free(&checkpoints);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#define MAX_STATES 8192
+#define MAX_ALPHABET_SIZE 16
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum { KEYWORDS = 1000, LENGTH = 20000 };
+
+static struct state_machine machine;
+static struct compiled_machine compiled;
+static char words[KEYWORDS][9];
+static const char *dictionary[KEYWORDS];
+static char text[LENGTH + 1];
+static size_t found[KEYWORDS];
+
+struct found {
+    const char *const *keywords;
+    int ids[8];
+    size_t starts[8], ends[8];
+    int count;
+    size_t last_end;
+};
+
+int record(int id, size_t start, size_t end, void *ctx) {
+    struct found *f = ctx;
+    assert(end - start == strlen(f->keywords[id]));
+    assert(f->count < 8);
+    f->ids[f->count] = id;
+    f->starts[f->count] = start;
+    f->ends[f->count++] = end;
+    return 0;
+}
+
+int tally(int id, size_t start, size_t end, void *ctx) {
+    size_t *last_end = ctx;
+    assert(!memcmp(text + start, dictionary[id], end - start));
+    assert(end >= *last_end);
+    *last_end = end;
+    found[id]++;
+    return 0;
+}
+
+int stop_after_five(int id, size_t start, size_t end, void *ctx) {
+    (void)id, (void)start, (void)end;
+    return ++*(int *)ctx == 5;
+}
+
+int main(void)
+{
+   /***********************************************************
+    * No state_table to write by hand this time: the          *
+    * machine is built from the keywords, with every          *
+    * failure link resolved into a plain transition.          *
+    *                                                         *
+    *          h        e             r       s               *
+    * START ------> 2 -----> [3 he] -----> 9 -----> [10 hers] *
+    *   |           |    i           s                        *
+    *   |           +-----> 7 -----> [8 his]                  *
+    *   | s                                                   *
+    *  \|/   h         e                                      *
+    *   4 -------> 5 -----> [6 she, he]                       *
+    **********************************************************/
+
+    const char *classic[] = { "he", "she", "his", "hers" };
+    struct keyword_outputs outputs;
+
+    int states = stately_keywords_init(&compiled, &machine, &outputs, classic, 4);
+    printf("he/she/his/hers: %d states\n", states);
+    assert(states == 11);
+
+    struct test_case {
+        const char *input;
+        int count;
+        int ids[4];
+        size_t ends[4];
+    };
+
+    struct test_case tests[] = {
+        { "ushers",       3, { 1, 0, 3 },    { 4, 4, 6 } },
+        { "his hers",     3, { 2, 0, 3 },    { 3, 6, 8 } },
+        { "hhe ishe",     3, { 0, 1, 0 },    { 3, 8, 8 } },
+        { "nothing",      0, { 0 },          { 0 } },
+        { "",             0, { 0 },          { 0 } },
+        { "\xff" "he\0",  1, { 0 },          { 3 } },
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        struct found f = { .keywords = classic };
+        size_t len = strlen(tests[i].input);
+        printf("Testing case %d:", i);
+        size_t matches = stately_keywords_scan(&compiled, &outputs, tests[i].input, len, record, &f);
+        for (int m = 0; m < f.count; m++) {
+            printf(" %s@%zu", classic[f.ids[m]], f.starts[m]);
+        }
+        puts("");
+        assert(matches == (size_t)tests[i].count && f.count == tests[i].count);
+        for (int m = 0; m < f.count; m++) {
+            assert(f.ids[m] == tests[i].ids[m] && f.ends[m] == tests[i].ends[m]);
+        }
+        assert(stately_scan(&compiled, compiled.start, tests[i].input, len) != 0);
+    }
+
+    int stopped = 0;
+    assert(stately_keywords_scan(&compiled, &outputs, "she hers she hers", 17, stop_after_five, &stopped) == 5);
+    stately_keywords_free(&outputs);
+
+    const char *empty[] = { "he", "" };
+    assert(stately_keywords_init(&compiled, &machine, &outputs, empty, 2) == -1);
+
+    // A thousand keywords over a small alphabet, so they overlap a lot,
+    // checked against comparing every keyword at every offset
+    unsigned int seed = 99;
+    for (int k = 0; k < KEYWORDS; k++) {
+        seed = seed * 1103515245u + 12345u;
+        int length = 3 + (int)((seed >> 16) % 6);
+        for (int c = 0; c < length; c++) {
+            seed = seed * 1103515245u + 12345u;
+            words[k][c] = "abcdefgh"[(seed >> 16) % 8];
+        }
+        dictionary[k] = words[k];
+    }
+    for (int i = 0; i < LENGTH; i++) {
+        seed = seed * 1103515245u + 12345u;
+        text[i] = "abcdefgh abcdefgh    "[(seed >> 16) % 21];
+    }
+
+    states = stately_keywords_init(&compiled, &machine, &outputs, dictionary, KEYWORDS);
+    printf("%d keywords: %d states\n", KEYWORDS, states);
+    assert(states > 0);
+
+    size_t last_end = 0;
+    size_t matches = stately_keywords_scan(&compiled, &outputs, text, LENGTH, tally, &last_end);
+    printf("%zu occurrences in %d bytes\n", matches, LENGTH);
+
+    size_t expected = 0;
+    for (int k = 0; k < KEYWORDS; k++) {
+        size_t length = strlen(dictionary[k]), count = 0;
+        for (size_t i = 0; i + length <= LENGTH; i++) {
+            count += !memcmp(text + i, dictionary[k], length);
+        }
+        assert(found[k] == count);
+        expected += count;
+    }
+    assert(matches == expected);
+
+    stately_keywords_free(&outputs);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -18,6 +18,21 @@ int request_to_state(const void *req_ptr) {
     return (req.a + req.b + req.c) % 2 ? ODD_INPUT : EVEN_INPUT;
 }
 
+// Struct-of-arrays version of `struct request` for batch mapping
+struct request_batch {
+    const int *a;
+    const int *b;
+    const int *c;
+};
+
+void requests_to_states(const void *batch_ptr, size_t first, size_t count, int *symbols) {
+    const struct request_batch *batch = batch_ptr;
+    const int *a = batch->a + first, *b = batch->b + first, *c = batch->c + first;
+    for (size_t i = 0; i < count; i++) {
+        symbols[i] = EVEN_INPUT + ((a[i] + b[i] + c[i]) & 1);
+    }
+}
+
 int main(void)
 {
    /*************************************************************************
@@ -58,6 +73,9 @@ int main(void)
         // Input mapper
         .map = request_to_state,
 
+        // Batch input mapper
+        .map_batch = requests_to_states,
+
         // States
         .state_table = {
 
@@ -138,6 +156,42 @@ int main(void)
         }
     }
 
+    {
+        puts("Test Three");
+        enum { COUNT = 1000 };
+        int a[COUNT], b[COUNT], c[COUNT];
+        struct request_batch batch = { a, b, c };
+        for (int i = 0; i < COUNT; i++) {
+            a[i] = i;
+            b[i] = i * 7;
+            c[i] = i % 3;
+        }
+
+        machine.curr_state = START;
+        for (int i = 0; i < COUNT; i++) {
+            struct request req = { a[i], b[i], c[i] };
+            (void)GET_NEXT_STATE(machine, &req);
+        }
+        int expected = GET_STATE(machine);
+
+        machine.curr_state = START;
+        (void)GET_NEXT_STATE_BATCH(machine, &batch, COUNT);
+        printf("Batch of %d requests ended in %s\n", COUNT, GET_STATE(machine) == EVEN_STATE ? "EVEN" : "ODD");
+        assert(GET_STATE(machine) == expected);
+
+        // Without map_batch(), the inputs are an array and map() is called on each
+        struct request requests[COUNT];
+        for (int i = 0; i < COUNT; i++) {
+            requests[i] = (struct request){ a[i], b[i], c[i] };
+        }
+        machine.map_batch = NULL;
+        machine.curr_state = START;
+        (void)GET_NEXT_STATE_BATCH(machine, requests, COUNT);
+        printf("Array of %d requests ended in %s\n", COUNT, GET_STATE(machine) == EVEN_STATE ? "EVEN" : "ODD");
+        assert(GET_STATE(machine) == expected);
+        machine.map_batch = requests_to_states;
+    }
+
     puts("Complete");
 
     return 0;
@@ -0,0 +1,116 @@
+// getcpu(), CPU affinity and friends are GNU extensions
+#define _GNU_SOURCE
+#define STATELY_THREADS
+#define STATELY_NUMA
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, ZERO_CHAR, ONE_CHAR };
+enum state { TRAP, ACCEPTING };
+
+const char char_map[128] = {
+    ['0'] = ZERO_CHAR,
+    ['1'] = ONE_CHAR,
+};
+
+int map_chr(const void *chr) {
+    return char_map[(int)*(const char *)chr];
+}
+
+enum { ENTITIES = 100003, THREADS = 4 };
+
+static int states[ENTITIES];
+static int expected[ENTITIES];
+static int symbols[ENTITIES];
+
+struct scan_job {
+    struct numa_machine *nm;
+    const char *input;
+    int results[THREADS];
+};
+
+// Every worker scans with whichever copy is local to it
+void scan_locally(void *ctx, int index, int count) {
+    struct scan_job *job = ctx;
+    const struct stately_replica *replica = stately_local(job->nm);
+    (void)count;
+    assert(replica && replica->compiled.machine == &replica->table);
+    job->results[index] = stately_scan(&replica->compiled, ACCEPTING, job->input, strlen(job->input));
+}
+
+int main(void)
+{
+   /***************************************
+    * The string-of-ones DFA, with a copy *
+    * of its table on every NUMA node.    *
+    **************************************/
+
+    static struct state_machine machine = {
+        .curr_state = ACCEPTING,
+        .map = map_chr,
+        .state_table = {
+            [ACCEPTING] = {
+                [ONE_CHAR] = ACCEPTING,
+            },
+        },
+    };
+
+    struct byte_classifier classifier;
+    struct compiled_machine compiled;
+    struct numa_machine nm;
+    struct stately_workers workers;
+
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+    stately_numa_init(&nm, &compiled);
+
+    int nodes = stately_node_count();
+    printf("%d NUMA node%s, running on node %d\n", nodes, nodes == 1 ? "" : "s", stately_current_node());
+    assert(nodes >= 1 && stately_current_node() < nodes);
+
+    // Made once per node, then reused
+    const struct stately_replica *local = stately_local(&nm);
+    assert(local && local == stately_local(&nm));
+    assert(!memcmp(local->table.state_table, machine.state_table, sizeof(machine.state_table)));
+    assert(local->compiled.start == compiled.start);
+
+    assert(stately_workers_start(&workers, THREADS) == 0);
+    stately_workers_pin(&workers);
+
+    struct scan_job job = { &nm, "1111111111111111111111111111111111111111", { 0 } };
+    stately_workers_run(&workers, scan_locally, &job);
+    for (int i = 0; i < THREADS; i++) {
+        assert(job.results[i] == ACCEPTING);
+    }
+    job.input = "1111111111111111111101111111111111111111";
+    stately_workers_run(&workers, scan_locally, &job);
+    for (int i = 0; i < THREADS; i++) {
+        assert(job.results[i] == TRAP);
+    }
+
+    // The pool steps through local copies too
+    struct state_pool pool;
+    stately_pool_init(&pool, &machine, states, ENTITIES);
+    for (int i = 0; i < ENTITIES; i++) {
+        expected[i] = ACCEPTING;
+    }
+    for (int tick = 0; tick < 3; tick++) {
+        for (int i = 0; i < ENTITIES; i++) {
+            symbols[i] = i % 97 == tick ? ZERO_CHAR : ONE_CHAR;
+            expected[i] = machine.state_table[expected[i]][symbols[i]];
+        }
+        stately_step_all_numa(&pool, &nm, symbols, &workers);
+        assert(!memcmp(states, expected, sizeof(states)));
+    }
+
+    stately_workers_stop(&workers);
+    stately_numa_free(&nm);
+
+    puts("Complete");
+
+    return 0;
+}
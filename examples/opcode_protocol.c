@@ -0,0 +1,125 @@
+// Only the symbol classes take up room in the state_table
+#define MAX_ALPHABET_SIZE 6
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, HELLO, AUTH, DATA, PING, BYE };
+enum state { TRAP, CONNECTED, GREETED, AUTHED, CLOSED };
+
+// A packet as it comes off the wire, keyed on a 16-bit opcode
+struct packet {
+    unsigned short opcode;
+};
+
+static struct symbol_table opcodes;
+
+int map_packet(const void *packet) {
+    return stately_symbol_class(&opcodes, ((const struct packet *)packet)->opcode);
+}
+
+int main(void)
+{
+   /***************************************************************
+    * A session over 65536 opcodes, of which only a handful of    *
+    * ranges mean anything. Everything else is a protocol error.  *
+    *                                                             *
+    *             HELLO           AUTH              BYE           *
+    * CONNECTED --------> GREETED -----> AUTHED ---------> CLOSED *
+    *                                   | /|\                     *
+    *                                   +--+ DATA, PING           *
+    **************************************************************/
+
+    const struct symbol_range ranges[] = {
+        { 0x0001, 0x0001, HELLO },
+        { 0x1000, 0x10ff, AUTH  },   // One opcode per auth method
+        { 0x2000, 0x7fff, DATA  },   // One opcode per channel
+        { 0x4242, 0x4242, PING  },   // Carved out of the channels
+        { 0xffff, 0xffff, BYE   },
+    };
+
+    assert(stately_symbols_init(&opcodes, ranges, sizeof(ranges) / sizeof(*ranges), 0x10000) == 0);
+    printf("%u distinct pages, %zu bytes (a flat table would need %zu per state)\n",
+        opcodes.page_count, stately_symbols_size(&opcodes), (size_t)0x10001 * sizeof(int));
+    assert(opcodes.page_count <= 2 * sizeof(ranges) / sizeof(*ranges) + 1);
+
+    assert(stately_symbol_class(&opcodes, 0x0000) == INVALID);
+    assert(stately_symbol_class(&opcodes, 0x0001) == HELLO);
+    assert(stately_symbol_class(&opcodes, 0x0fff) == INVALID);
+    assert(stately_symbol_class(&opcodes, 0x1000) == AUTH);
+    assert(stately_symbol_class(&opcodes, 0x10ff) == AUTH);
+    assert(stately_symbol_class(&opcodes, 0x1100) == INVALID);
+    assert(stately_symbol_class(&opcodes, 0x4241) == DATA);
+    assert(stately_symbol_class(&opcodes, 0x4242) == PING);
+    assert(stately_symbol_class(&opcodes, 0x7fff) == DATA);
+    assert(stately_symbol_class(&opcodes, 0xfffe) == INVALID);
+    assert(stately_symbol_class(&opcodes, 0xffff) == BYE);
+    assert(stately_symbol_class(&opcodes, 0x10000) == INVALID);
+
+    struct state_machine machine = {
+
+        // Start state
+        .curr_state = CONNECTED,
+
+        // Input mapper
+        .map = map_packet,
+
+        // States
+        .state_table = {
+
+            [CONNECTED] = {
+                [HELLO] = GREETED,
+            },
+
+            [GREETED] = {
+                [AUTH] = AUTHED,
+                [PING] = GREETED,
+            },
+
+            [AUTHED] = {
+                [DATA] = AUTHED,
+                [PING] = AUTHED,
+                [BYE]  = CLOSED,
+            },
+
+        }
+
+    };
+
+    printf("Machine is %zu bytes\n", sizeof(machine));
+
+    struct test_case {
+        struct packet inputs[8];
+        int expected_result;
+    };
+
+    struct test_case tests[] = {
+        { { { 0x0001 } },                                           GREETED },
+        { { { 0x0001 }, { 0x1003 } },                               AUTHED  },
+        { { { 0x0001 }, { 0x4242 }, { 0x10ff }, { 0x2000 } },       AUTHED  },
+        { { { 0x0001 }, { 0x1003 }, { 0x7fff }, { 0xffff } },       CLOSED  },
+        { { { 0x0001 }, { 0x1100 } },                               TRAP    },
+        { { { 0x0001 }, { 0x2000 } },                               TRAP    },
+        { { { 0x1003 } },                                           TRAP    },
+        { { { 0x0001 }, { 0x1003 }, { 0xfffe } },                   TRAP    },
+        { { { 0x0001 }, { 0x1003 }, { 0xffff }, { 0x2000 } },       TRAP    },
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        SET_STATE(machine, CONNECTED);
+        printf("Testing case %d:", i);
+        for (int p = 0; p < 8 && tests[i].inputs[p].opcode; p++) {
+            printf(" %04x->%d", tests[i].inputs[p].opcode, GET_NEXT_STATE(machine, &tests[i].inputs[p]));
+        }
+        puts("");
+        assert(GET_STATE(machine) == tests[i].expected_result);
+    }
+
+    stately_symbols_free(&opcodes);
+
+    puts("Complete");
+
+    return 0;
+}
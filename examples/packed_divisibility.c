@@ -0,0 +1,121 @@
+// A generated machine much bigger than the hand-written ones
+#define MAX_STATES 2048
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum { DIVISOR = 1999 };
+
+// Symbol d + 1 is digit d, state r + 1 is remainder r (so TRAP stays 0)
+enum input { INVALID };
+enum state { TRAP, DIVISIBLE };
+
+int map_chr(const void *chr) {
+    char c = *(const char *)chr;
+    return c >= '0' && c <= '9' ? c - '0' + 1 : INVALID;
+}
+
+static struct state_machine machine;
+
+int main(void)
+{
+   /****************************************************************
+    * Decimal numbers of any length that are divisible by 1999.    *
+    * Reading digit d in remainder r goes to remainder             *
+    * (10r + d) mod 1999, so there are 1999 states with 10         *
+    * transitions each and 247 holes per row.                      *
+    ***************************************************************/
+
+    machine.curr_state = DIVISIBLE;
+    machine.map = map_chr;
+    for (int r = 0; r < DIVISOR; r++) {
+        for (int d = 0; d < 10; d++) {
+            machine.state_table[r + 1][d + 1] = (10 * r + d) % DIVISOR + 1;
+        }
+    }
+
+    struct packed_machine packed;
+
+    assert(stately_pack(&packed, &machine) == 0);
+    printf("Packed %d states into %zu cells (%zu bytes, the state_table is %zu)\n",
+        packed.states, packed.cell_count,
+        packed.cell_count * sizeof(*packed.cells) + (size_t)packed.states * sizeof(*packed.base),
+        sizeof(machine.state_table));
+    assert(packed.states == DIVISOR + 1);
+    assert(packed.cell_count < 2 * 10 * DIVISOR + MAX_ALPHABET_SIZE + 1);
+
+    // Every cell agrees with the table, holes included
+    for (int s = 0; s < packed.states; s++) {
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            assert(stately_packed_step(&packed, s, c) == machine.state_table[s][c]);
+        }
+    }
+
+    // So do the states past the packed ones: empty rows
+    for (int s = packed.states; s < MAX_STATES; s++) {
+        assert(stately_packed_step(&packed, s, 1) == 0);
+    }
+
+    struct test_case {
+        char input[48];
+        int expected_result;
+    };
+
+    struct test_case tests[] = {
+        { "0",                                  DIVISIBLE },
+        { "1999",                               DIVISIBLE },
+        { "3998",                               DIVISIBLE },
+        { "2000",                               2         },
+        { "1998",                               DIVISOR   },
+        { "0001999",                            DIVISIBLE },
+        { "3996001",                            DIVISIBLE },   // 1999 * 1999
+        { "9999999999999999999999999999999999", 0         },   // Filled in below
+        { "19x99",                              TRAP      },
+        { "-1999",                              TRAP      },
+    };
+
+    // Long division by hand for the big one
+    int remainder = 0;
+    for (const char *c = tests[7].input; *c; c++) {
+        remainder = (10 * remainder + *c - '0') % DIVISOR;
+    }
+    tests[7].expected_result = remainder + 1;
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        SET_STATE(machine, DIVISIBLE);
+        packed.curr_state = DIVISIBLE;
+        printf("Testing case %d: %s\n", i, tests[i].input);
+        for (const char *c = tests[i].input; *c; c++) {
+            assert(stately_packed_next(&packed, c) == GET_NEXT_STATE(machine, c));
+        }
+        assert(GET_STATE(machine) == tests[i].expected_result);
+        assert(packed.curr_state == tests[i].expected_result);
+
+        packed.curr_state = DIVISIBLE;
+        assert(stately_packed_run(&packed, tests[i].input, 1, strlen(tests[i].input)) == tests[i].expected_result);
+    }
+
+    // Bytes through a classifier
+    struct byte_classifier classifier;
+    char digits[1000];
+    unsigned int seed = 7;
+
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    remainder = 0;
+    for (int i = 0; i < (int)sizeof(digits); i++) {
+        seed = seed * 1103515245u + 12345u;
+        digits[i] = (char)('0' + (seed >> 16) % 10);
+        remainder = (10 * remainder + digits[i] - '0') % DIVISOR;
+    }
+    packed.curr_state = DIVISIBLE;
+    assert(stately_packed_run_bytes(&packed, &classifier, digits, sizeof(digits)) == remainder + 1);
+
+    stately_packed_free(&packed);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+// Stage one reads characters and emits digits
+enum input { INVALID, DIGIT_CHAR, SEPARATOR };
+enum digit { NO_OUTPUT, DIGIT };
+enum normalizer_state { NORMALIZER_TRAP, NORMALIZING };
+
+// Stage two reads digits and emits where the groups end
+enum group { NO_GROUP, AREA_CODE, EXCHANGE, LINE };
+enum validator_state {
+    VALIDATOR_TRAP,
+    DIGITS_0, DIGITS_1, DIGITS_2, DIGITS_3, DIGITS_4, DIGITS_5,
+    DIGITS_6, DIGITS_7, DIGITS_8, DIGITS_9, COMPLETE,
+};
+
+const char char_map[128] = {
+    ['0'] = DIGIT_CHAR, ['1'] = DIGIT_CHAR, ['2'] = DIGIT_CHAR, ['3'] = DIGIT_CHAR, ['4'] = DIGIT_CHAR,
+    ['5'] = DIGIT_CHAR, ['6'] = DIGIT_CHAR, ['7'] = DIGIT_CHAR, ['8'] = DIGIT_CHAR, ['9'] = DIGIT_CHAR,
+    [' '] = SEPARATOR, ['-'] = SEPARATOR, ['.'] = SEPARATOR, ['('] = SEPARATOR, [')'] = SEPARATOR,
+};
+
+int map_chr(const void *chr) {
+    return char_map[(int)*(const char *)chr];
+}
+
+int map_digit(const void *digit) {
+    return *(const int *)digit;
+}
+
+static struct mealy_machine normalizer = {
+
+    // Start state
+    .curr_state = NORMALIZING,
+
+    // Input mapper
+    .map = map_chr,
+
+    // States
+    .state_table = {
+        [NORMALIZING] = {
+            [DIGIT_CHAR] = NORMALIZING,
+            [SEPARATOR]  = NORMALIZING,
+        },
+    },
+
+    // Outputs (separators are dropped)
+    .output_table = {
+        [NORMALIZING] = {
+            [DIGIT_CHAR] = DIGIT,
+        },
+    },
+
+};
+
+static struct mealy_machine validator = {
+
+    // Start state
+    .curr_state = DIGITS_0,
+
+    // Input mapper
+    .map = map_digit,
+
+    // States
+    .state_table = {
+        [DIGITS_0] = { [DIGIT] = DIGITS_1 },
+        [DIGITS_1] = { [DIGIT] = DIGITS_2 },
+        [DIGITS_2] = { [DIGIT] = DIGITS_3 },
+        [DIGITS_3] = { [DIGIT] = DIGITS_4 },
+        [DIGITS_4] = { [DIGIT] = DIGITS_5 },
+        [DIGITS_5] = { [DIGIT] = DIGITS_6 },
+        [DIGITS_6] = { [DIGIT] = DIGITS_7 },
+        [DIGITS_7] = { [DIGIT] = DIGITS_8 },
+        [DIGITS_8] = { [DIGIT] = DIGITS_9 },
+        [DIGITS_9] = { [DIGIT] = COMPLETE },
+    },
+
+    // Outputs
+    .output_table = {
+        [DIGITS_2] = { [DIGIT] = AREA_CODE },
+        [DIGITS_5] = { [DIGIT] = EXCHANGE },
+        [DIGITS_9] = { [DIGIT] = LINE },
+    },
+
+};
+
+static struct mealy_machine pipeline;
+
+int main(void)
+{
+   /*********************************************************
+    * Two stages: the normalizer drops the separators from  *
+    * a phone number and emits each digit, the validator    *
+    * counts exactly ten digits and emits where the groups  *
+    * end. Composed, they run in one pass over the chars.   *
+    *                                                       *
+    *   "(555) 123-4567" --> normalizer --> DDDDDDDDDD      *
+    *                                                       *
+    *   DDDDDDDDDD --> validator --> AREA_CODE, EXCHANGE,   *
+    *                                LINE                   *
+    ********************************************************/
+
+    int pair_of[MAX_STATES][2];
+
+    int states = stately_compose(&pipeline, pair_of, &normalizer, &validator);
+    printf("Composed into %d states\n", states);
+    assert(states == COMPLETE + 1);
+    assert(pair_of[GET_STATE(pipeline)][0] == NORMALIZING && pair_of[GET_STATE(pipeline)][1] == DIGITS_0);
+
+    struct test_case {
+        char input[24];
+        int expected_result;
+        int expected_outputs;
+    };
+
+    struct test_case tests[] = {
+        { "(555) 123-4567", COMPLETE,       3 },
+        { "555.123.4567",   COMPLETE,       3 },
+        { "5551234567",     COMPLETE,       3 },
+        { "--5551234567--", COMPLETE,       3 },
+        { "",               DIGITS_0,       0 },
+        { "555-1234",       DIGITS_7,       2 },
+        { "555-123-45678",  VALIDATOR_TRAP, 3 },   // Too many digits
+        { "555-abc-4567",   VALIDATOR_TRAP, 1 },   // Not a digit at all
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        size_t len = strlen(tests[i].input);
+        int digits[24], groups[24], fused[24];
+
+        // Back to back, with the digits in between
+        SET_STATE(normalizer, NORMALIZING);
+        SET_STATE(validator, DIGITS_0);
+        size_t digit_count = stately_mealy_run(&normalizer, tests[i].input, 1, len, digits);
+        size_t group_count = stately_mealy_run(&validator, digits, sizeof(*digits), digit_count, groups);
+        int staged = GET_STATE(normalizer) && GET_STATE(validator) ? GET_STATE(validator) : VALIDATOR_TRAP;
+
+        // In one pass
+        SET_STATE(pipeline, 1);
+        size_t fused_count = stately_mealy_run(&pipeline, tests[i].input, 1, len, fused);
+        int result = pair_of[GET_STATE(pipeline)][1];
+
+        printf("Testing case %d: %-16s -> %2d, %zu groups\n", i, tests[i].input, result, fused_count);
+        assert(result == tests[i].expected_result);
+        assert(result == staged);
+
+        // The stream before the trap is the same either way
+        assert(fused_count == (size_t)tests[i].expected_outputs);
+        assert(fused_count <= group_count && !memcmp(fused, groups, fused_count * sizeof(*fused)));
+    }
+
+    puts("Complete");
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+// perf_event_open() needs syscall(), which -std=c99 hides
+#define _DEFAULT_SOURCE
+#define STATELY_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { INVALID, ZERO_CHAR, ONE_CHAR };
+enum state { TRAP, ACCEPTING };
+
+const char char_map[128] = {
+    ['0'] = ZERO_CHAR,
+    ['1'] = ONE_CHAR,
+};
+
+int map_chr(const void *chr) {
+    return char_map[(int)*(const char *)chr];
+}
+
+enum { LENGTH = 1 << 20, ROUNDS = 8 };
+
+static char ones[LENGTH];
+
+// At file scope so STATELY_DEFINE_MACHINE can name its table
+static struct state_machine machine = {
+    .curr_state = ACCEPTING,
+    .map = map_chr,
+    .state_table = {
+        [ACCEPTING] = {
+            [ONE_CHAR] = ACCEPTING,
+        },
+    },
+};
+
+STATELY_DEFINE_MACHINE(ones_machine, map_chr, machine.state_table)
+
+int main(void)
+{
+   /****************************************
+    * The string-of-ones DFA again, on a   *
+    * megabyte of ones, through each of    *
+    * the engines with counters around it. *
+    ***************************************/
+
+    struct byte_classifier classifier;
+    struct compiled_machine compiled;
+    struct packed_machine packed;
+    struct stately_counters counters;
+
+    memset(ones, '1', sizeof(ones));
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+    assert(stately_pack(&packed, &machine) == 0);
+
+    if (stately_counters_open(&counters)) {
+        puts("No hardware counters here (perf_event_paranoid, or a VM), reporting zeros");
+    } else {
+        printf("Opened %d of %d counters\n", counters.opened, STATELY_COUNTERS);
+    }
+
+    struct stately_profile sites[] = {
+        { .name = "GET_NEXT_STATE" },
+        { .name = "stately_run_bytes" },
+        { .name = "stately_packed_run_bytes" },
+        { .name = "stately_scan" },
+        { .name = "STATELY_DEFINE_MACHINE" },
+    };
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int state;
+
+        STATELY_PROFILED(&counters, &sites[0], LENGTH, {
+            SET_STATE(machine, ACCEPTING);
+            for (int i = 0; i < LENGTH; i++) {
+                (void)GET_NEXT_STATE(machine, &ones[i]);
+            }
+            state = GET_STATE(machine);
+        });
+        assert(state == ACCEPTING);
+
+        SET_STATE(machine, ACCEPTING);
+        STATELY_PROFILED(&counters, &sites[1], LENGTH, state = stately_run_bytes(&machine, &classifier, ones, LENGTH));
+        assert(state == ACCEPTING);
+
+        packed.curr_state = ACCEPTING;
+        STATELY_PROFILED(&counters, &sites[2], LENGTH, state = stately_packed_run_bytes(&packed, &classifier, ones, LENGTH));
+        assert(state == ACCEPTING);
+
+        STATELY_PROFILED(&counters, &sites[3], LENGTH, state = stately_scan(&compiled, ACCEPTING, ones, LENGTH));
+        assert(state == ACCEPTING);
+
+        STATELY_PROFILED(&counters, &sites[4], LENGTH, state = ones_machine_run(ACCEPTING, ones, 1, LENGTH));
+        assert(state == ACCEPTING);
+    }
+
+    stately_profile_report(stdout, sites, 5);
+    for (int i = 0; i < 5; i++) {
+        assert(sites[i].calls == ROUNDS && sites[i].bytes == (unsigned long long)ROUNDS * LENGTH);
+    }
+    printf("Self-loop skipping saves %.2f cycles per byte\n",
+        stately_per_byte(&sites[1], STATELY_CYCLES) - stately_per_byte(&sites[3], STATELY_CYCLES));
+
+    // The generated functions agree with GET_NEXT_STATE, traps included
+    const char *strings[] = { "", "1", "111", "10", "0", "1101", "2" };
+    for (int i = 0; i < (int)(sizeof(strings) / sizeof(*strings)); i++) {
+        SET_STATE(machine, ACCEPTING);
+        for (const char *c = strings[i]; *c; c++) {
+            (void)GET_NEXT_STATE(machine, c);
+        }
+        assert(ones_machine_run_string(ACCEPTING, strings[i]) == GET_STATE(machine));
+    }
+    assert(ones_machine_step(ACCEPTING, "1") == ACCEPTING);
+    assert(ones_machine_step(ACCEPTING, "0") == TRAP);
+
+    stately_counters_close(&counters);
+    stately_packed_free(&packed);
+
+    puts("Complete");
+
+    return 0;
+}
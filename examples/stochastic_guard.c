@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum input { NOTHING, SEE_PLAYER, LOSE_PLAYER, HEAR_NOISE };
+enum state { TRAP, PATROL, CHASE, FLEE, INVESTIGATE };
+enum distribution { CHASE_OR_FLEE, WANDER };
+
+int map_event(const void *event) {
+    return *(const int *)event;
+}
+
+enum { ENTITIES = 100003, DRAWS = 1000000 };
+
+static int states[ENTITIES];
+static int symbols[ENTITIES];
+
+int main(void)
+{
+   /***********************************************************
+    * A guard that isn't always brave: seeing the player      *
+    * means a 70% chance to chase and 30% to flee. Hearing a  *
+    * noise while patrolling sends it to investigate, keep    *
+    * patrolling or (rarely) flee, 5:4:1.                     *
+    *                                                         *
+    *             SEE_PLAYER  70%                             *
+    *   PATROL ------------------> CHASE                      *
+    *     |    \                                              *
+    *     |     +----------------> FLEE                       *
+    *     |       SEE_PLAYER  30%                             *
+    *     | HEAR_NOISE                                        *
+    *     +--------> INVESTIGATE 50% / PATROL 40% / FLEE 10%  *
+    *                                                         *
+    *   LOSE_PLAYER from anywhere --> PATROL                  *
+    **********************************************************/
+
+    static struct state_machine machine = {
+
+        // Start state
+        .curr_state = PATROL,
+
+        // Input mapper
+        .map = map_event,
+
+        // States
+        .state_table = {
+
+            [PATROL] = {
+                [NOTHING]     = PATROL,
+                [SEE_PLAYER]  = STOCHASTIC(CHASE_OR_FLEE),
+                [LOSE_PLAYER] = PATROL,
+                [HEAR_NOISE]  = STOCHASTIC(WANDER),
+            },
+
+            [CHASE] = {
+                [NOTHING]     = CHASE,
+                [SEE_PLAYER]  = CHASE,
+                [LOSE_PLAYER] = PATROL,
+                [HEAR_NOISE]  = CHASE,
+            },
+
+            [FLEE] = {
+                [NOTHING]     = FLEE,
+                [SEE_PLAYER]  = FLEE,
+                [LOSE_PLAYER] = PATROL,
+                [HEAR_NOISE]  = FLEE,
+            },
+
+            [INVESTIGATE] = {
+                [NOTHING]     = INVESTIGATE,
+                [SEE_PLAYER]  = STOCHASTIC(CHASE_OR_FLEE),
+                [LOSE_PLAYER] = PATROL,
+                [HEAR_NOISE]  = INVESTIGATE,
+            },
+
+        }
+
+    };
+
+    const struct stately_distribution distributions[] = {
+        [CHASE_OR_FLEE] = { 2, { CHASE, FLEE },              { 0.7, 0.3 } },
+        [WANDER]        = { 3, { INVESTIGATE, PATROL, FLEE }, { 5, 4, 1 } },
+    };
+
+    static struct stochastic_table table;
+    struct stately_rng rng = { 42 };
+
+    assert(stately_stochastic_init(&table, distributions, 2) == 0);
+
+    // The alias tables reproduce the weights
+    puts("Sampling the distributions");
+    for (int d = 0; d < 2; d++) {
+        int seen[INVESTIGATE + 1] = { 0 };
+        double total = 0;
+        for (int i = 0; i < distributions[d].count; i++) {
+            total += distributions[d].weight[i];
+        }
+        for (int i = 0; i < DRAWS; i++) {
+            seen[stately_resolve(&table, STOCHASTIC(d), stately_rng_next(&rng))]++;
+        }
+        for (int i = 0; i < distributions[d].count; i++) {
+            double expected = distributions[d].weight[i] / total, got = (double)seen[distributions[d].to[i]] / DRAWS;
+            printf("    distribution %d, state %d: %.4f (expected %.4f)\n", d, distributions[d].to[i], got, expected);
+            assert(got > expected - 0.005 && got < expected + 0.005);
+        }
+    }
+
+    // One guard at a time
+    puts("One guard");
+    int event = SEE_PLAYER;
+    SET_STATE(machine, PATROL);
+    int first = stately_stochastic_next(&machine, &table, &event, &rng);
+    assert(first == CHASE || first == FLEE);
+    event = LOSE_PLAYER;
+    assert(stately_stochastic_next(&machine, &table, &event, &rng) == PATROL);
+
+    // A whole pool at once
+    struct state_pool pool;
+    size_t counts[INVESTIGATE + 1] = { 0 };
+    stately_pool_init(&pool, &machine, states, ENTITIES);
+    for (int i = 0; i < ENTITIES; i++) {
+        symbols[i] = i % 2 ? SEE_PLAYER : NOTHING;
+    }
+
+    struct stately_rng replay = rng;
+    stately_step_all_stochastic(&pool, &table, symbols, &rng);
+    for (int i = 0; i < ENTITIES; i++) {
+        counts[states[i]]++;
+        assert(i % 2 ? states[i] == CHASE || states[i] == FLEE : states[i] == PATROL);
+    }
+    printf("Pool: %zu patrolling, %zu chasing, %zu fleeing\n", counts[PATROL], counts[CHASE], counts[FLEE]);
+    assert(counts[CHASE] > 0.68 * (ENTITIES / 2) && counts[CHASE] < 0.72 * (ENTITIES / 2));
+
+    // The same stream gives the same guards, and moves on by one draw each
+    struct stately_rng after = replay;
+    after.state += ENTITIES * STATELY_GOLDEN;
+    assert(rng.state == after.state);
+    for (int i = 0; i < ENTITIES; i++) {
+        int next = machine.state_table[PATROL][symbols[i]];
+        unsigned long long draw = stately_mix64(replay.state + (unsigned long long)(i + 1) * STATELY_GOLDEN);
+        assert(stately_resolve(&table, next, draw) == states[i]);
+    }
+
+    // Bad distributions
+    const struct stately_distribution empty = { 0, { 0 }, { 0 } }, weightless = { 1, { PATROL }, { 0 } };
+    assert(stately_stochastic_init(&table, &empty, 1) == -1);
+    assert(stately_stochastic_init(&table, &weightless, 1) == -1);
+
+    puts("Complete");
+
+    return 0;
+}
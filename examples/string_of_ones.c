@@ -16,57 +16,60 @@ int map_chr(const void *chr) {
     return char_map[(int)*(const char *)chr];
 }
 
-int main(void)
-{
-   /***************************************
-    *  DFA that accepts either the empty  *
-    *  string, or any sequence of 1s.     *
-    *                                     *
-    *       1                    0,1      *
-    *    +-----+               +----+     *
-    *    |     |               |    |     *
-    *    |    \|/              |   \|/    *
-    * +--+---------+       +---+--------+ *
-    * |            |       |            | *
-    * | Accepting  |       |  Rejecting | *
-    * |            |       |            | *
-    * +-----+------+       +------------+ *
-    *       |                    /|\      *
-    *       |                     |       *
-    *       |                     |       *
-    *       +---------------------+       *
-    *                 0                   *
-    **************************************/
-
-    struct state_machine machine = {
-       
-        // Start state
-        .curr_state = ACCEPTING,
-
-        // Input mapper
-        .map = map_chr,
-
-        // States
-        .state_table = {
-
-            // Reject state transitions
-            [TRAP] = {
-                [INVALID]   = TRAP,
-                [ZERO_CHAR] = TRAP,
-                [ONE_CHAR]  = TRAP,
-            },
-
-            // Accept state transitions
-            [ACCEPTING] = {
-                [INVALID]   = TRAP,
-                [ZERO_CHAR] = TRAP,
-                [ONE_CHAR]  = ACCEPTING,
-            }
-
+/***************************************
+ *  DFA that accepts either the empty  *
+ *  string, or any sequence of 1s.     *
+ *                                     *
+ *       1                    0,1      *
+ *    +-----+               +----+     *
+ *    |     |               |    |     *
+ *    |    \|/              |   \|/    *
+ * +--+---------+       +---+--------+ *
+ * |            |       |            | *
+ * | Accepting  |       |  Rejecting | *
+ * |            |       |            | *
+ * +-----+------+       +------------+ *
+ *       |                    /|\      *
+ *       |                     |       *
+ *       |                     |       *
+ *       +---------------------+       *
+ *                 0                   *
+ **************************************/
+
+// At file scope, so STATELY_DEFINE_MACHINE() below can name its table
+static struct state_machine machine = {
+
+    // Start state
+    .curr_state = ACCEPTING,
+
+    // Input mapper
+    .map = map_chr,
+
+    // States
+    .state_table = {
+
+        // Reject state transitions
+        [TRAP] = {
+            [INVALID]   = TRAP,
+            [ZERO_CHAR] = TRAP,
+            [ONE_CHAR]  = TRAP,
+        },
+
+        // Accept state transitions
+        [ACCEPTING] = {
+            [INVALID]   = TRAP,
+            [ZERO_CHAR] = TRAP,
+            [ONE_CHAR]  = ACCEPTING,
         }
 
-    };
+    }
 
+};
+
+STATELY_DEFINE_MACHINE(ones, map_chr, machine.state_table)
+
+int main(void)
+{
     struct test_case {
         char input[16];
         int expected_result;
@@ -89,6 +92,68 @@ int main(void)
         assert(GET_STATE(machine) == tests[i].expected_result);
     }
 
+    // The same loop through the generated functions, which call map_chr()
+    // directly instead of through machine.map
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        printf("Testing specialized case '%s'\n", tests[i].input);
+        int state = ACCEPTING;
+        for (int c = 0; tests[i].input[c]; c++) {
+            state = ones_step(state, &tests[i].input[c]);
+        }
+        assert(state == tests[i].expected_result);
+        assert(ones_run_string(ACCEPTING, tests[i].input) == tests[i].expected_result);
+        assert(ones_run(ACCEPTING, tests[i].input, 1, strlen(tests[i].input)) == tests[i].expected_result);
+    }
+
+    struct byte_classifier classifier;
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        printf("Testing classified case '%s'\n", tests[i].input);
+        SET_STATE(machine, ACCEPTING);
+        (void)stately_run_bytes(&machine, &classifier, tests[i].input, strlen(tests[i].input));
+        assert(GET_STATE(machine) == tests[i].expected_result);
+    }
+
+    struct compiled_machine compiled;
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        printf("Testing compiled case '%s'\n", tests[i].input);
+        assert(stately_scan(&compiled, ACCEPTING, tests[i].input, strlen(tests[i].input)) == tests[i].expected_result);
+    }
+
+    {
+        // Long enough to go through the vectorized classifier, and with
+        // bytes >= 128 that char_map[] cannot be indexed with
+        char input[300];
+        memset(input, '1', sizeof(input));
+
+        puts("Testing 300 classified 1s");
+        SET_STATE(machine, ACCEPTING);
+        assert(stately_run_bytes(&machine, &classifier, input, sizeof(input)) == ACCEPTING);
+
+        puts("Testing 300 classified 1s with a '0' at 250");
+        input[250] = '0';
+        SET_STATE(machine, ACCEPTING);
+        assert(stately_run_bytes(&machine, &classifier, input, sizeof(input)) == TRAP);
+
+        puts("Testing 300 classified 1s with a '\\xb1' at 70");
+        input[250] = '1';
+        input[70] = (char)0xb1;
+        SET_STATE(machine, ACCEPTING);
+        assert(stately_run_bytes(&machine, &classifier, input, sizeof(input)) == TRAP);
+        assert(stately_scan(&compiled, ACCEPTING, input, sizeof(input)) == TRAP);
+
+        input[70] = '1';
+        assert(stately_scan(&compiled, ACCEPTING, input, sizeof(input)) == ACCEPTING);
+        for (int c = 0; c < (int)sizeof(input); c += 37) {
+            input[c] = '0';
+            assert(stately_scan(&compiled, ACCEPTING, input, sizeof(input)) == TRAP);
+            input[c] = '1';
+        }
+    }
+
     puts("Complete");
 
     return 0;
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stately.h"
+
+enum state { TRAP, START, NAME, EMOJI };
+
+int main(void)
+{
+   /****************************************************************
+    * Identifiers in any of a few scripts, or a single emoji.      *
+    * The transitions are written in code points and compiled      *
+    * into a machine over bytes, which also rejects malformed      *
+    * UTF-8 along the way.                                         *
+    *                                                              *
+    *          letter               letter, digit, '_'             *
+    *  START ----------> NAME <---------------+                    *
+    *    |                 |                  |                    *
+    *    |                 +------------------+                    *
+    *    |  U+1F600-U+1F64F                                        *
+    *    +-----------------> EMOJI                                 *
+    ***************************************************************/
+
+    const struct codepoint_transition transitions[] = {
+        { START, 'A',     'Z',     NAME  },
+        { START, 'a',     'z',     NAME  },
+        { START, 0xc0,    0xff,    NAME  },   // Latin-1 letters (and two symbols, close enough)
+        { START, 0x391,   0x3c9,   NAME  },   // Greek
+        { START, 0x4e00,  0x9fff,  NAME  },   // CJK
+        { START, 0x1f600, 0x1f64f, EMOJI },
+
+        { NAME,  'A',     'Z',     NAME  },
+        { NAME,  'a',     'z',     NAME  },
+        { NAME,  '0',     '9',     NAME  },
+        { NAME,  '_',     '_',     NAME  },
+        { NAME,  0xc0,    0xff,    NAME  },
+        { NAME,  0x391,   0x3c9,   NAME  },
+        { NAME,  0x4e00,  0x9fff,  NAME  },
+    };
+
+    static struct state_machine machine;
+
+    int states = stately_compile_utf8(&machine, transitions, sizeof(transitions) / sizeof(*transitions), START);
+    printf("Compiled into %d byte-level states\n", states);
+    assert(states > EMOJI + 1 && states < MAX_STATES);
+    assert(machine.map == stately_map_byte);
+
+    struct test_case {
+        const char *input;
+        int expected_result;
+    };
+
+    struct test_case tests[] = {
+        { "hello",                          NAME  },
+        { "h\xc3\xa9llo",                   NAME  },   // héllo
+        { "\xce\xb1\xce\xb2\xce\xb3_1",     NAME  },   // αβγ_1
+        { "\xe6\x97\xa5\xe6\x9c\xac",       NAME  },   // 日本
+        { "x\xe6\x97\xa5" "2",              NAME  },
+        { "\xf0\x9f\x98\x80",               EMOJI },   // U+1F600
+        { "\xf0\x9f\x99\x8f",               EMOJI },   // U+1F64F
+        { "\xf0\x9f\x99\x90",               TRAP  },   // U+1F650, just past the range
+        { "\xf0\x9f\x98\x80x",              TRAP  },
+        { "1abc",                           TRAP  },
+        { "a-b",                            TRAP  },
+        { "\xc3\x97",                       NAME  },   // ×, the price of the Latin-1 shortcut
+        { "\xce\x90",                       TRAP  },   // U+0390, just before Greek
+        { "\xcf\x8a",                       TRAP  },   // U+03CA, just after
+        { "a\xc3",                          TRAP  },   // Truncated é
+        { "\xc0\xaf",                       TRAP  },   // Overlong '/'
+        { "\xe0\x80\xaf",                   TRAP  },   // Overlong '/' again
+        { "\xed\xa0\x80",                   TRAP  },   // Surrogate
+        { "\xf4\x90\x80\x80",               TRAP  },   // Past U+10FFFF
+        { "\xa9",                           TRAP  },   // Stray continuation byte
+    };
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        SET_STATE(machine, START);
+        printf("Testing case %d:", i);
+        for (const char *c = tests[i].input; *c; c++) {
+            printf(" %d", GET_NEXT_STATE(machine, c));
+        }
+        puts("");
+
+        // A truncated sequence stops in an intermediate state, which is
+        // never accepting
+        int result = GET_STATE(machine) > EMOJI ? TRAP : GET_STATE(machine);
+        assert(result == tests[i].expected_result);
+    }
+
+    // Same thing through the compiled engine
+    struct byte_classifier classifier;
+    struct compiled_machine compiled;
+
+    SET_STATE(machine, START);
+    assert(stately_classifier_init(&classifier, stately_map_byte, 256) == 0);
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        int result = stately_scan(&compiled, START, (const unsigned char *)tests[i].input, strlen(tests[i].input));
+        assert((result > EMOJI ? TRAP : result) == tests[i].expected_result);
+    }
+
+    // Transitions out of one state must not overlap
+    const struct codepoint_transition ambiguous[] = {
+        { START, 0x391, 0x3c9, NAME  },
+        { START, 0x3c0, 0x3c0, EMOJI },
+    };
+    assert(stately_compile_utf8(&machine, ambiguous, 2, START) == -1);
+
+    puts("Complete");
+
+    return 0;
+}
@@ -118,5 +118,37 @@ int main(void)
         assert(GET_STATE(machine) == tests[i].expected_result);
     }
 
+    struct byte_classifier classifier;
+    struct compiled_machine compiled;
+    assert(stately_classifier_init(&classifier, map_chr, 128) == 0);
+    assert(stately_compile(&compiled, &machine, &classifier) == 0);
+
+    // States 3, 5 and 8 loop on digits, so their runs are skipped
+    assert(compiled.loops[3].count == 1 && compiled.loops[3].lo[0] == '0' && compiled.loops[3].hi[0] == '9');
+    assert(compiled.loops[5].count == 1 && compiled.loops[8].count == 1);
+    assert(compiled.loops[1].count == 0 && compiled.loops[6].count == 0);
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(*tests)); i++) {
+        printf("Testing compiled case '%s'\n", tests[i].input);
+        assert(stately_scan(&compiled, 1, tests[i].input, strlen(tests[i].input)) == tests[i].expected_result);
+    }
+
+    {
+        // -<1000 digits>.<1000 digits>e+<1000 digits>
+        static char input[3005];
+        memset(input, '7', sizeof(input) - 1);
+        input[0] = '-';
+        input[1001] = '.';
+        input[2002] = 'e';
+        input[2003] = '+';
+
+        puts("Testing long compiled case");
+        assert(stately_scan(&compiled, 1, input, strlen(input)) == 8);
+
+        input[2500] = '.';
+        puts("Testing long compiled case with a '.' in the exponent");
+        assert(stately_scan(&compiled, 1, input, strlen(input)) == 0);
+    }
+
     return 0;
 }
@@ -1,6 +1,23 @@
 #ifndef STATELY_H
 #define STATELY_H
 
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/uio.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#if !defined(STATELY_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+# include <immintrin.h>
+#endif
+
 #ifndef MAX_ALPHABET_SIZE
 # define MAX_ALPHABET_SIZE 256
 #endif
@@ -9,15 +26,3476 @@
 # define MAX_STATES 128
 #endif
 
+#ifndef STATELY_BATCH_SIZE
+# define STATELY_BATCH_SIZE 256
+#endif
+
 #define SET_STATE(machine, state)(machine.curr_state = state)
 #define GET_STATE(machine)(machine.curr_state)
 #define SUPPOSE_STATE(machine, state, input)(machine.state_table[machine.curr_state][machine.map(input)])
 #define GET_NEXT_STATE(machine, input)(machine.curr_state = SUPPOSE_STATE(machine, machine.curr_state, input), GET_STATE(machine))
+#define GET_NEXT_STATE_BATCH(machine, inputs, count)(stately_run_batch(&(machine), inputs, sizeof(*(inputs)), count))
 
 struct state_machine {
     int curr_state;
     int (*map)(const void *);
+    void (*map_batch)(const void *, size_t, size_t, int *);
+    int state_table[MAX_STATES][MAX_ALPHABET_SIZE + 1];
+};
+
+// Feeds an array of already-mapped input symbols to the machine
+static inline int stately_run_symbols(struct state_machine *machine, const int *symbols, size_t count)
+{
+    int state = machine->curr_state;
+    for (size_t i = 0; i < count; i++) {
+        state = machine->state_table[state][symbols[i]];
+    }
+    return machine->curr_state = state;
+}
+
+// Maps inputs [0, count) through map_batch() in blocks of STATELY_BATCH_SIZE
+// and feeds the resulting symbols to the machine. Machines without a
+// map_batch() get map() called on each input, taking them as an array of
+// `size`-byte elements like qsort() does.
+static inline int stately_run_batch(struct state_machine *machine, const void *inputs, size_t size, size_t count)
+{
+    int symbols[STATELY_BATCH_SIZE];
+    for (size_t first = 0; first < count; first += STATELY_BATCH_SIZE) {
+        size_t n = count - first < STATELY_BATCH_SIZE ? count - first : STATELY_BATCH_SIZE;
+        if (machine->map_batch) {
+            machine->map_batch(inputs, first, n, symbols);
+        } else {
+            const char *p = (const char *)inputs + first * size;
+            for (size_t i = 0; i < n; i++, p += size) {
+                symbols[i] = machine->map(p);
+            }
+        }
+        (void)stately_run_symbols(machine, symbols, n);
+    }
+    return machine->curr_state;
+}
+
+// Byte -> symbol lookup built from a char map() function
+struct byte_classifier {
+    unsigned char classes[256];
+    unsigned short rows;
+};
+
+// Evaluates map() for bytes [0, range) (128 for the usual `char_map[128]`
+// mappers) and classifies every other byte as 0 (INVALID). Fails if map()
+// returns a symbol that does not fit in a byte or past MAX_ALPHABET_SIZE.
+static inline int stately_classifier_init(struct byte_classifier *cls, int (*map)(const void *), int range)
+{
+    memset(cls, 0, sizeof(*cls));
+    for (int b = 0; b < range && b < 256; b++) {
+        char chr = (char)b;
+        int symbol = map(&chr);
+        if (symbol < 0 || symbol > 255 || symbol > MAX_ALPHABET_SIZE) {
+            return -1;
+        }
+        cls->classes[b] = (unsigned char)symbol;
+        if (symbol) {
+            cls->rows |= (unsigned short)(1u << (b >> 4));
+        }
+    }
+    return 0;
+}
+
+// Writes the symbol of each of the `len` bytes into `symbols`. Bytes are
+// looked up 16 at a time per high nibble with pshufb (only for high nibbles
+// that have a non-INVALID byte), or 64 at a time with vpermb on AVX-512 VBMI.
+static inline void stately_classify(const struct byte_classifier *cls, const void *bytes, size_t len, unsigned char *symbols)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t i = 0;
+#if !defined(STATELY_NO_SIMD) && defined(__AVX512VBMI__) && defined(__AVX512BW__)
+    __m512i t0 = _mm512_loadu_si512((const void *)(cls->classes));
+    __m512i t1 = _mm512_loadu_si512((const void *)(cls->classes + 64));
+    __m512i t2 = _mm512_loadu_si512((const void *)(cls->classes + 128));
+    __m512i t3 = _mm512_loadu_si512((const void *)(cls->classes + 192));
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(p + i));
+        __m512i ascii = _mm512_permutex2var_epi8(t0, v, t1);
+        __m512i high = _mm512_permutex2var_epi8(t2, v, t3);
+        _mm512_storeu_si512((void *)(symbols + i), _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), ascii, high));
+    }
+#elif !defined(STATELY_NO_SIMD) && defined(__AVX2__)
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i out = _mm256_setzero_si256();
+        for (int h = 0; h < 16; h++) {
+            if (cls->rows & (1u << h)) {
+                __m256i row = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(cls->classes + 16 * h)));
+                __m256i in_row = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)h));
+                out = _mm256_or_si256(out, _mm256_and_si256(_mm256_shuffle_epi8(row, lo), in_row));
+            }
+        }
+        _mm256_storeu_si256((__m256i *)(symbols + i), out);
+    }
+#elif !defined(STATELY_NO_SIMD) && defined(__SSSE3__)
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_and_si128(v, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i out = _mm_setzero_si128();
+        for (int h = 0; h < 16; h++) {
+            if (cls->rows & (1u << h)) {
+                __m128i row = _mm_loadu_si128((const __m128i *)(cls->classes + 16 * h));
+                __m128i in_row = _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)h));
+                out = _mm_or_si128(out, _mm_and_si128(_mm_shuffle_epi8(row, lo), in_row));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(symbols + i), out);
+    }
+#endif
+    for (; i < len; i++) {
+        symbols[i] = cls->classes[p[i]];
+    }
+}
+
+// Classifies `len` bytes in blocks of STATELY_BATCH_SIZE and feeds the
+// symbols to the machine
+static inline int stately_run_bytes(struct state_machine *machine, const struct byte_classifier *cls, const void *bytes, size_t len)
+{
+    unsigned char symbols[STATELY_BATCH_SIZE];
+    const unsigned char *p = (const unsigned char *)bytes;
+    int state = machine->curr_state;
+    for (size_t first = 0; first < len; first += STATELY_BATCH_SIZE) {
+        size_t n = len - first < STATELY_BATCH_SIZE ? len - first : STATELY_BATCH_SIZE;
+        stately_classify(cls, p + first, n, symbols);
+        for (size_t i = 0; i < n; i++) {
+            state = machine->state_table[state][symbols[i]];
+        }
+    }
+    return machine->curr_state = state;
+}
+
+#ifndef STATELY_ACCEL_RANGES
+# define STATELY_ACCEL_RANGES 4
+#endif
+
+// A set of bytes stored as inclusive [lo, hi] ranges
+struct byte_ranges {
+    int count;
+    unsigned char lo[STATELY_ACCEL_RANGES];
+    unsigned char hi[STATELY_ACCEL_RANGES];
+};
+
+// Builds ranges from a 256-entry membership array. Fails if the set needs
+// more than STATELY_ACCEL_RANGES ranges.
+static inline int stately_ranges_init(struct byte_ranges *ranges, const unsigned char set[256])
+{
+    ranges->count = 0;
+    for (int b = 0; b < 256; b++) {
+        if (!set[b]) {
+            continue;
+        }
+        if (ranges->count == STATELY_ACCEL_RANGES) {
+            ranges->count = 0;
+            return -1;
+        }
+        ranges->lo[ranges->count] = (unsigned char)b;
+        while (b < 255 && set[b + 1]) {
+            b++;
+        }
+        ranges->hi[ranges->count++] = (unsigned char)b;
+    }
+    return 0;
+}
+
+static inline int stately_ranges_contain(const struct byte_ranges *ranges, unsigned char byte)
+{
+    for (int k = 0; k < ranges->count; k++) {
+        if (byte >= ranges->lo[k] && byte <= ranges->hi[k]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns the length of the prefix of `bytes` made up of bytes in the set
+// (or, with `invert`, made up of bytes not in the set), testing 16 (SSE2)
+// or 32 (AVX2) bytes per iteration
+static inline size_t stately_ranges_scan(const struct byte_ranges *ranges, const void *bytes, size_t len, int invert)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t i = 0;
+    if (ranges->count == 1 && ranges->lo[0] == 0 && ranges->hi[0] == 255) {
+        return invert ? 0 : len;
+    }
+#if !defined(STATELY_NO_SIMD) && defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i in = _mm256_setzero_si256();
+        for (int k = 0; k < ranges->count; k++) {
+            __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8((char)ranges->lo[k]));
+            __m256i w = _mm256_set1_epi8((char)(ranges->hi[k] - ranges->lo[k]));
+            in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(d, w), d));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(in) ^ (invert ? 0xffffffffu : 0);
+        if (mask != 0xffffffffu) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+#elif !defined(STATELY_NO_SIMD) && defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i in = _mm_setzero_si128();
+        for (int k = 0; k < ranges->count; k++) {
+            __m128i d = _mm_sub_epi8(v, _mm_set1_epi8((char)ranges->lo[k]));
+            __m128i w = _mm_set1_epi8((char)(ranges->hi[k] - ranges->lo[k]));
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, w), d));
+        }
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(in) ^ (invert ? 0xffffu : 0);
+        if (mask != 0xffffu) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+#endif
+    while (i < len && stately_ranges_contain(ranges, p[i]) != invert) {
+        i++;
+    }
+    return i;
+}
+
+static inline size_t stately_ranges_span(const struct byte_ranges *ranges, const void *bytes, size_t len)
+{
+    return stately_ranges_scan(ranges, bytes, len, 0);
+}
+
+// Returns the offset of the first byte in the set, or `len` if there is none
+static inline size_t stately_ranges_find(const struct byte_ranges *ranges, const void *bytes, size_t len)
+{
+    return stately_ranges_scan(ranges, bytes, len, 1);
+}
+
+// A state_machine paired with a byte classifier and per-state self-loop
+// byte sets, for scanning `char` input
+struct compiled_machine {
+    const struct state_machine *machine;
+    struct byte_classifier classifier;
+    struct byte_ranges loops[MAX_STATES];
+    int start;
+    unsigned char accepting[MAX_STATES];
+    unsigned char first_bytes[256];
+    struct byte_ranges first;
+};
+
+// Finds every state whose self-loop covers at most STATELY_ACCEL_RANGES
+// byte ranges, and the bytes that leave the start state (the machine's
+// curr_state) for anything other than TRAP. The machine is referenced, not
+// copied. Fails if the classifier produces a class past MAX_ALPHABET_SIZE.
+static inline int stately_compile(struct compiled_machine *cm, const struct state_machine *machine, const struct byte_classifier *cls)
+{
+#if MAX_ALPHABET_SIZE < 255
+    for (int b = 0; b < 256; b++) {
+        if (cls->classes[b] > MAX_ALPHABET_SIZE) {
+            return -1;
+        }
+    }
+#endif
+    cm->machine = machine;
+    cm->classifier = *cls;
+    cm->start = machine->curr_state;
+    memset(cm->accepting, 0, sizeof(cm->accepting));
+    for (int s = 0; s < MAX_STATES; s++) {
+        unsigned char set[256];
+        for (int b = 0; b < 256; b++) {
+            set[b] = machine->state_table[s][cls->classes[b]] == s;
+        }
+        (void)stately_ranges_init(&cm->loops[s], set);
+    }
+    for (int b = 0; b < 256; b++) {
+        cm->first_bytes[b] = machine->state_table[cm->start][cls->classes[b]] != 0;
+    }
+    (void)stately_ranges_init(&cm->first, cm->first_bytes);
+    return 0;
+}
+
+// Marks a state as accepting for the search drivers
+static inline void stately_accept(struct compiled_machine *cm, int state)
+{
+    cm->accepting[state] = 1;
+}
+
+// Runs `len` bytes from `state` and returns the final state. Whenever the
+// machine is in a state with an accelerated self-loop, the run of looping
+// bytes is skipped with stately_ranges_span() instead of being stepped.
+static inline int stately_scan(const struct compiled_machine *cm, int state, const void *bytes, size_t len)
+{
+    unsigned char symbols[STATELY_BATCH_SIZE];
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t i = 0;
+    while (i < len) {
+        size_t n = len - i < STATELY_BATCH_SIZE ? len - i : STATELY_BATCH_SIZE;
+        size_t j = 0;
+        stately_classify(&cm->classifier, p + i, n, symbols);
+        while (j < n) {
+            if (cm->loops[state].count) {
+                j += stately_ranges_span(&cm->loops[state], p + i + j, len - i - j);
+                if (j >= n) {
+                    break;
+                }
+            }
+            state = cm->machine->state_table[state][symbols[j++]];
+        }
+        i += j;
+    }
+    return state;
+}
+
+// Returns the offset of the first byte that can start a match, or `len`
+static inline size_t stately_prefilter(const struct compiled_machine *cm, const void *bytes, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t i = 0;
+    if (cm->first.count) {
+        return stately_ranges_find(&cm->first, p, len);
+    }
+    while (i < len && !cm->first_bytes[p[i]]) {
+        i++;
+    }
+    return i;
+}
+
+// Runs the machine from the start state at `bytes` until it traps and
+// returns the length of the longest accepted prefix (0 if there is none)
+static inline size_t stately_match_longest(const struct compiled_machine *cm, const void *bytes, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    const struct state_machine *machine = cm->machine;
+    int state = cm->start;
+    size_t i = 0, end = 0;
+    while (i < len) {
+        state = machine->state_table[state][cm->classifier.classes[p[i++]]];
+        if (state == 0) {
+            break;
+        }
+        if (cm->loops[state].count) {
+            i += stately_ranges_span(&cm->loops[state], p + i, len - i);
+        }
+        if (cm->accepting[state]) {
+            end = i;
+        }
+    }
+    return end;
+}
+
+// Reports every non-overlapping, non-empty match in `bytes` to on_match()
+// as [start, end) offsets, leftmost-longest first. The scan restarts one
+// byte later whenever a candidate start does not match, and candidate
+// starts are found with stately_prefilter(). on_match() may be NULL, or
+// return nonzero to stop the search. Returns the number of matches.
+static inline size_t stately_search(const struct compiled_machine *cm, const void *bytes, size_t len,
+                                    int (*on_match)(size_t, size_t, void *), void *ctx)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t pos = 0, matches = 0;
+    while (pos < len) {
+        pos += stately_prefilter(cm, p + pos, len - pos);
+        if (pos >= len) {
+            break;
+        }
+        size_t end = stately_match_longest(cm, p + pos, len - pos);
+        if (!end) {
+            pos++;
+            continue;
+        }
+        matches++;
+        if (on_match && on_match(pos, pos + end, ctx)) {
+            break;
+        }
+        pos += end;
+    }
+    return matches;
+}
+
+// Number of states in use: one more than the highest state that is the
+// current state, has a transition, or is the target of one
+static inline int stately_state_count(const struct state_machine *machine)
+{
+    int count = machine->curr_state + 1;
+    for (int s = 0; s < MAX_STATES; s++) {
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            int next = machine->state_table[s][c];
+            if (next && s >= count) {
+                count = s + 1;
+            }
+            if (next >= count) {
+                count = next + 1;
+            }
+        }
+    }
+    return count;
+}
+
+// Number of symbols a classifier produces: one more than the highest one
+static inline int stately_class_count(const struct byte_classifier *cls)
+{
+    int count = 1;
+    for (int b = 0; b < 256; b++) {
+        if (cls->classes[b] >= count) {
+            count = cls->classes[b] + 1;
+        }
+    }
+    return count;
+}
+
+// Subset construction over the states of `cm`. With `reverse` unset, a set
+// steps to the images of its states and `seed` is added after every step
+// (so the result also starts a match at every offset); with `reverse` set,
+// a set steps to the states that lead into it and `seed` is the accepting
+// set. The empty set becomes TRAP (0), and the result is compiled into
+// `out` with `table` as storage. A set is accepting if it contains an
+// accepting state (forward) or the start state (reverse). Returns the
+// number of states, or -1 if more than MAX_STATES sets are reachable.
+static inline int stately_determinize(struct compiled_machine *out, struct state_machine *table,
+                                      const struct compiled_machine *cm, int reverse)
+{
+    const int (*delta)[MAX_ALPHABET_SIZE + 1] = cm->machine->state_table;
+    int n = stately_state_count(cm->machine), classes = stately_class_count(&cm->classifier);
+    size_t words = ((size_t)n + 63) / 64;
+    unsigned long long *sets = (unsigned long long *)calloc((size_t)MAX_STATES * words, sizeof(*sets));
+    unsigned long long *next = (unsigned long long *)calloc(words, sizeof(*next));
+    int count = 2;
+    if (!sets || !next) {
+        free(sets);
+        free(next);
+        return -1;
+    }
+
+    memset(table, 0, sizeof(*table));
+    table->map = cm->machine->map;
+    table->curr_state = 1;
+    for (int q = 1; q < n; q++) {
+        if (reverse ? cm->accepting[q] : q == cm->start) {
+            sets[words + (size_t)q / 64] |= 1ull << (q % 64);
+        }
+    }
+
+    for (int id = 1; id < count; id++) {
+        const unsigned long long *set = sets + (size_t)id * words;
+        for (int c = 0; c < classes; c++) {
+            int empty = 1, found = 0;
+            memset(next, 0, words * sizeof(*next));
+            for (int q = 1; q < n; q++) {
+                int t = delta[q][c];
+                if (reverse ? t && (set[t / 64] >> (t % 64) & 1) : (set[q / 64] >> (q % 64) & 1) && t) {
+                    int member = reverse ? q : t;
+                    next[member / 64] |= 1ull << (member % 64);
+                    empty = 0;
+                }
+            }
+            if (!reverse) {
+                for (size_t w = 0; w < words; w++) {
+                    next[w] |= sets[words + w];
+                }
+                empty = 0;
+            }
+            if (empty) {
+                continue;
+            }
+            for (int other = 1; other < count && !found; other++) {
+                if (!memcmp(sets + (size_t)other * words, next, words * sizeof(*next))) {
+                    found = other;
+                }
+            }
+            if (!found) {
+                if (count == MAX_STATES) {
+                    free(sets);
+                    free(next);
+                    return -1;
+                }
+                found = count++;
+                memcpy(sets + (size_t)found * words, next, words * sizeof(*next));
+            }
+            table->state_table[id][c] = found;
+        }
+    }
+
+    (void)stately_compile(out, table, &cm->classifier);
+    for (int id = 1; id < count; id++) {
+        const unsigned long long *set = sets + (size_t)id * words;
+        for (int q = 1; q < n; q++) {
+            if ((set[q / 64] >> (q % 64) & 1) && (reverse ? q == cm->start : cm->accepting[q])) {
+                stately_accept(out, id);
+            }
+        }
+    }
+    free(sets);
+    free(next);
+    return count;
+}
+
+// Machines for two-pass searching: an unanchored forward machine that
+// accepts wherever a match ends, and the reversed machine that, run
+// backwards from a match end, accepts wherever the match could start
+struct reverse_search {
+    struct state_machine forward_table;
+    struct state_machine reverse_table;
+    struct compiled_machine forward;
+    struct compiled_machine reverse;
+};
+
+static inline int stately_reverse_search_init(struct reverse_search *rs, const struct compiled_machine *cm)
+{
+    if (stately_determinize(&rs->forward, &rs->forward_table, cm, 0) < 0) {
+        return -1;
+    }
+    if (stately_determinize(&rs->reverse, &rs->reverse_table, cm, 1) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reports non-overlapping, non-empty matches like stately_search(), in two
+// linear passes: the forward machine finds the earliest offset at which a
+// match ends, then the reverse machine runs back from there to find the
+// leftmost offset that match can start at, and the forward scan carries on
+// from the end. For fixed-length machines (such as dates) this finds the
+// same matches as stately_search().
+static inline size_t stately_search_reverse(const struct reverse_search *rs, const void *bytes, size_t len,
+                                            int (*on_match)(size_t, size_t, void *), void *ctx)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    const struct compiled_machine *fwd = &rs->forward, *rev = &rs->reverse;
+    size_t pos = 0, i = 0, matches = 0;
+    int state = fwd->start;
+    while (i < len) {
+        if (fwd->loops[state].count && !fwd->accepting[state]) {
+            i += stately_ranges_span(&fwd->loops[state], p + i, len - i);
+            if (i >= len) {
+                break;
+            }
+        }
+        state = fwd->machine->state_table[state][fwd->classifier.classes[p[i++]]];
+        if (!fwd->accepting[state]) {
+            continue;
+        }
+
+        size_t start = i;
+        int back = rev->start;
+        for (size_t j = i; j > pos; j--) {
+            back = rev->machine->state_table[back][rev->classifier.classes[p[j - 1]]];
+            if (back == 0) {
+                break;
+            }
+            if (rev->accepting[back]) {
+                start = j - 1;
+            }
+        }
+        if (start == i) {
+            continue;
+        }
+
+        matches++;
+        if (on_match && on_match(start, i, ctx)) {
+            break;
+        }
+        pos = i;
+        state = fwd->start;
+    }
+    return matches;
+}
+
+// Current states of many entities sharing one machine
+struct state_pool {
+    const struct state_machine *machine;
+    int *states;
+    size_t count;
+};
+
+// Puts every entity in `states` in the machine's curr_state
+static inline void stately_pool_init(struct state_pool *pool, const struct state_machine *machine, int *states, size_t count)
+{
+    pool->machine = machine;
+    pool->states = states;
+    pool->count = count;
+    for (size_t i = 0; i < count; i++) {
+        states[i] = machine->curr_state;
+    }
+}
+
+// states[i] = state_table[states[i]][symbols[i]] for i in [0, count), with
+// AVX2/AVX-512 gathers doing 8/16 entities per instruction
+static inline void stately_step_states(const struct state_machine *machine, int *states, const int *symbols, size_t count)
+{
+    size_t i = 0;
+#if !defined(STATELY_NO_SIMD) && defined(__AVX512F__)
+    const __m512i row16 = _mm512_set1_epi32(MAX_ALPHABET_SIZE + 1);
+    for (; i + 16 <= count; i += 16) {
+        __m512i s = _mm512_loadu_si512((const void *)(states + i));
+        __m512i c = _mm512_loadu_si512((const void *)(symbols + i));
+        __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(s, row16), c);
+        _mm512_storeu_si512((void *)(states + i), _mm512_i32gather_epi32(index, (const void *)machine->state_table, 4));
+    }
+#endif
+#if !defined(STATELY_NO_SIMD) && defined(__AVX2__)
+    const __m256i row8 = _mm256_set1_epi32(MAX_ALPHABET_SIZE + 1);
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(states + i));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(symbols + i));
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(s, row8), c);
+        _mm256_storeu_si256((__m256i *)(states + i), _mm256_i32gather_epi32(&machine->state_table[0][0], index, 4));
+    }
+#endif
+    for (; i < count; i++) {
+        states[i] = machine->state_table[states[i]][symbols[i]];
+    }
+}
+
+// Feeds entity i symbols[i] for every entity in the pool
+static inline void stately_step_all(struct state_pool *pool, const int *symbols)
+{
+    stately_step_states(pool->machine, pool->states, symbols, pool->count);
+}
+
+// Splits [0, count) into `parts` contiguous slices (rounded to 64-byte
+// lines of `int`s so that neighbouring slices never share a cache line)
+// and returns slice `part`
+static inline void stately_split(size_t count, int part, int parts, size_t *begin, size_t *end)
+{
+    size_t lines = (count + 15) / 16;
+    *begin = lines * (size_t)part / (size_t)parts * 16;
+    *end = lines * (size_t)(part + 1) / (size_t)parts * 16;
+    if (*begin > count) {
+        *begin = count;
+    }
+    if (*end > count) {
+        *end = count;
+    }
+}
+
+#ifdef STATELY_THREADS
+#include <pthread.h>
+
+#ifndef STATELY_MAX_THREADS
+# define STATELY_MAX_THREADS 64
+#endif
+
+struct stately_workers;
+
+struct stately_worker {
+    struct stately_workers *workers;
+    int index;
+    pthread_t thread;
+};
+
+// A fixed set of threads that all run the same job, for splitting work
+// such as stately_step_all_parallel() without spawning threads per tick
+struct stately_workers {
+    int count;
+    struct stately_worker worker[STATELY_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned long generation;
+    int busy;
+    int quit;
+    void (*job)(void *, int, int);
+    void *ctx;
+};
+
+static inline void *stately_worker_main(void *arg)
+{
+    struct stately_worker *self = (struct stately_worker *)arg;
+    struct stately_workers *w = self->workers;
+    unsigned long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->generation == seen && !w->quit) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if (w->quit) {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        seen = w->generation;
+        void (*job)(void *, int, int) = w->job;
+        void *ctx = w->ctx;
+        pthread_mutex_unlock(&w->lock);
+
+        job(ctx, self->index, w->count);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->busy == 0) {
+            pthread_cond_signal(&w->done);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static inline void stately_workers_stop(struct stately_workers *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 1; i < w->count; i++) {
+        pthread_join(w->worker[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->done);
+}
+
+// Starts `count - 1` threads; the thread calling stately_workers_run() is
+// the remaining worker (index 0). If a thread can't be started, the ones
+// that were are stopped again before returning -1.
+static inline int stately_workers_start(struct stately_workers *w, int count)
+{
+    if (count < 1 || count > STATELY_MAX_THREADS) {
+        return -1;
+    }
+    memset(w, 0, sizeof(*w));
+    w->count = count;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->done, NULL);
+    for (int i = 1; i < count; i++) {
+        w->worker[i].workers = w;
+        w->worker[i].index = i;
+        if (pthread_create(&w->worker[i].thread, NULL, stately_worker_main, &w->worker[i])) {
+            w->count = i;
+            stately_workers_stop(w);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Runs job(ctx, index, count) on every worker and waits for all of them
+static inline void stately_workers_run(struct stately_workers *w, void (*job)(void *, int, int), void *ctx)
+{
+    pthread_mutex_lock(&w->lock);
+    w->job = job;
+    w->ctx = ctx;
+    w->busy = w->count - 1;
+    w->generation++;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+
+    job(ctx, 0, w->count);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->busy) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+struct stately_step_job {
+    struct state_pool *pool;
+    const int *symbols;
+};
+
+static inline void stately_step_slice(void *ctx, int index, int count)
+{
+    struct stately_step_job *job = (struct stately_step_job *)ctx;
+    size_t begin, end;
+    stately_split(job->pool->count, index, count, &begin, &end);
+    stately_step_states(job->pool->machine, job->pool->states + begin, job->symbols + begin, end - begin);
+}
+
+// stately_step_all() with the pool split evenly across the workers
+static inline void stately_step_all_parallel(struct state_pool *pool, const int *symbols, struct stately_workers *w)
+{
+    struct stately_step_job job = { pool, symbols };
+    stately_workers_run(w, stately_step_slice, &job);
+}
+#endif
+
+// A pending input for one entity. Queued events of an entity are chained
+// through `next`; unused events form a free list the same way.
+struct stately_event {
+    int entity;
+    int symbol;
+    int next;
+};
+
+// An input delivered to an entity once the scheduler reaches tick `due`
+struct stately_timer {
+    unsigned long due;
+    unsigned long seq;
+    int entity;
+    int symbol;
+};
+
+// Timers due on the same tick go off in the order they were posted
+static inline int stately_timer_before(const struct stately_timer *a, const struct stately_timer *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+// Steps only the entities of a pool that have pending inputs
+struct state_scheduler {
+    struct state_pool *pool;
+    unsigned long tick;
+    int *head;
+    int *tail;
+    struct stately_event *events;
+    int event_capacity;
+    int free_event;
+    struct stately_timer *timers;
+    size_t timer_count;
+    size_t timer_capacity;
+    unsigned long timer_seq;
+    int *ready;
+    size_t ready_count;
+    int *batch_states;
+    int *batch_symbols;
+};
+
+static inline void stately_scheduler_free(struct state_scheduler *s)
+{
+    free(s->head);
+    free(s->tail);
+    free(s->events);
+    free(s->timers);
+    free(s->ready);
+    free(s->batch_states);
+    free(s->batch_symbols);
+    memset(s, 0, sizeof(*s));
+}
+
+// Allocates room for `event_capacity` queued inputs and `timer_capacity`
+// delayed ones across the whole pool
+static inline int stately_scheduler_init(struct state_scheduler *s, struct state_pool *pool, int event_capacity, size_t timer_capacity)
+{
+    memset(s, 0, sizeof(*s));
+    s->pool = pool;
+    s->head = (int *)malloc(pool->count * sizeof(*s->head));
+    s->tail = (int *)malloc(pool->count * sizeof(*s->tail));
+    s->events = (struct stately_event *)malloc((size_t)event_capacity * sizeof(*s->events));
+    s->timers = (struct stately_timer *)malloc(timer_capacity * sizeof(*s->timers));
+    s->ready = (int *)malloc(pool->count * sizeof(*s->ready));
+    s->batch_states = (int *)malloc(pool->count * sizeof(*s->batch_states));
+    s->batch_symbols = (int *)malloc(pool->count * sizeof(*s->batch_symbols));
+    if (!s->head || !s->tail || !s->events || !s->timers || !s->ready || !s->batch_states || !s->batch_symbols) {
+        stately_scheduler_free(s);
+        return -1;
+    }
+    s->event_capacity = event_capacity;
+    s->timer_capacity = timer_capacity;
+    for (size_t i = 0; i < pool->count; i++) {
+        s->head[i] = -1;
+    }
+    for (int e = 0; e < event_capacity; e++) {
+        s->events[e].next = e + 1 < event_capacity ? e + 1 : -1;
+    }
+    s->free_event = event_capacity ? 0 : -1;
+    return 0;
+}
+
+// Queues `symbol` for `entity`, to be fed on the next stately_tick().
+// Fails if all events are in use.
+static inline int stately_post(struct state_scheduler *s, int entity, int symbol)
+{
+    int e = s->free_event;
+    if (e < 0) {
+        return -1;
+    }
+    s->free_event = s->events[e].next;
+    s->events[e].entity = entity;
+    s->events[e].symbol = symbol;
+    s->events[e].next = -1;
+    if (s->head[entity] < 0) {
+        s->head[entity] = e;
+        s->ready[s->ready_count++] = entity;
+    } else {
+        s->events[s->tail[entity]].next = e;
+    }
+    s->tail[entity] = e;
+    return 0;
+}
+
+// Queues `symbol` for `entity` on the tick `delay` ticks from now (0 being
+// the next stately_tick()). Fails if all timers are in use.
+static inline int stately_post_delayed(struct state_scheduler *s, int entity, int symbol, unsigned long delay)
+{
+    size_t i = s->timer_count;
+    if (i == s->timer_capacity) {
+        return -1;
+    }
+    struct stately_timer timer = { s->tick + delay, s->timer_seq++, entity, symbol };
+    s->timer_count++;
+    while (i && stately_timer_before(&timer, &s->timers[(i - 1) / 2])) {
+        s->timers[i] = s->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->timers[i] = timer;
+    return 0;
+}
+
+static inline void stately_pop_timer(struct state_scheduler *s)
+{
+    struct stately_timer last = s->timers[--s->timer_count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= s->timer_count) {
+            break;
+        }
+        if (child + 1 < s->timer_count && stately_timer_before(&s->timers[child + 1], &s->timers[child])) {
+            child++;
+        }
+        if (!stately_timer_before(&s->timers[child], &last)) {
+            break;
+        }
+        s->timers[i] = s->timers[child];
+        i = child;
+    }
+    s->timers[i] = last;
+}
+
+// Moves due timers onto their entities' queues, then feeds every queued
+// input in order: each round gathers the next input of every entity that
+// has one, steps them as one batch and scatters the states back. Returns
+// the number of inputs fed; idle entities are never touched.
+static inline size_t stately_tick(struct state_scheduler *s)
+{
+    struct state_pool *pool = s->pool;
+    size_t stepped = 0;
+    while (s->timer_count && s->timers[0].due <= s->tick) {
+        if (stately_post(s, s->timers[0].entity, s->timers[0].symbol) < 0) {
+            break;
+        }
+        stately_pop_timer(s);
+    }
+    while (s->ready_count) {
+        size_t n = s->ready_count, still_ready = 0;
+        for (size_t k = 0; k < n; k++) {
+            int entity = s->ready[k], e = s->head[entity];
+            s->batch_states[k] = pool->states[entity];
+            s->batch_symbols[k] = s->events[e].symbol;
+            s->head[entity] = s->events[e].next;
+            s->events[e].next = s->free_event;
+            s->free_event = e;
+        }
+        stately_step_states(pool->machine, s->batch_states, s->batch_symbols, n);
+        for (size_t k = 0; k < n; k++) {
+            int entity = s->ready[k];
+            pool->states[entity] = s->batch_states[k];
+            if (s->head[entity] >= 0) {
+                s->ready[still_ready++] = entity;
+            }
+        }
+        s->ready_count = still_ready;
+        stepped += n;
+    }
+    s->tick++;
+    return stepped;
+}
+
+// Per-state callbacks, each called once with every entity in that state
+struct state_dispatch {
+    void (*behavior[MAX_STATES])(int state, const int *entities, size_t count, void *ctx);
+    void (*on_enter[MAX_STATES])(int state, const int *entities, size_t count, void *ctx);
+    void (*on_exit[MAX_STATES])(int state, const int *entities, size_t count, void *ctx);
+};
+
+// Counting sort of the entities i in [0, count) for which `keep` is NULL
+// or keep[i] != keys[i], by keys[i]. Writes the entity indices to
+// `entities` and the start of each key's bucket to offsets[key].
+static inline void stately_bucket(const int *keys, const int *keep, size_t count, int *entities, size_t offsets[MAX_STATES + 1])
+{
+    memset(offsets, 0, (MAX_STATES + 1) * sizeof(*offsets));
+    for (size_t i = 0; i < count; i++) {
+        if (!keep || keep[i] != keys[i]) {
+            offsets[keys[i] + 1]++;
+        }
+    }
+    for (int s = 0; s < MAX_STATES; s++) {
+        offsets[s + 1] += offsets[s];
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!keep || keep[i] != keys[i]) {
+            entities[offsets[keys[i]]++] = (int)i;
+        }
+    }
+    memmove(offsets + 1, offsets, MAX_STATES * sizeof(*offsets));
+    offsets[0] = 0;
+}
+
+static inline void stately_dispatch_buckets(void (*const callbacks[MAX_STATES])(int, const int *, size_t, void *),
+                                            const int *entities, const size_t offsets[MAX_STATES + 1], void *ctx)
+{
+    for (int s = 0; s < MAX_STATES; s++) {
+        if (callbacks[s] && offsets[s + 1] > offsets[s]) {
+            callbacks[s](s, entities + offsets[s], offsets[s + 1] - offsets[s], ctx);
+        }
+    }
+}
+
+// Calls behavior[state] once per state with the (ascending) indices of
+// the entities currently in it. `scratch` must hold pool->count ints.
+static inline void stately_dispatch(const struct state_dispatch *d, const struct state_pool *pool, int *scratch, void *ctx)
+{
+    size_t offsets[MAX_STATES + 1];
+    stately_bucket(pool->states, NULL, pool->count, scratch, offsets);
+    stately_dispatch_buckets(d->behavior, scratch, offsets, ctx);
+}
+
+// Given each entity's state `before` the last step, calls on_exit[state]
+// with the entities that left each state, then on_enter[state] with the
+// entities that entered each state. `scratch` must hold pool->count ints.
+static inline void stately_dispatch_changes(const struct state_dispatch *d, const int *before, const struct state_pool *pool, int *scratch, void *ctx)
+{
+    size_t offsets[MAX_STATES + 1];
+    stately_bucket(before, pool->states, pool->count, scratch, offsets);
+    stately_dispatch_buckets(d->on_exit, scratch, offsets, ctx);
+    stately_bucket(pool->states, before, pool->count, scratch, offsets);
+    stately_dispatch_buckets(d->on_enter, scratch, offsets, ctx);
+}
+
+#ifndef STATELY_MAX_HISTORY
+# define STATELY_MAX_HISTORY 8
+#endif
+
+// In a hierarchical state_table, a transition to EXPLICIT_TRAP rejects the
+// input instead of inheriting the transition from the parent state
+#define EXPLICIT_TRAP (-1)
+#define SHALLOW_HISTORY 1
+#define DEEP_HISTORY 2
+
+// States nested in parent states. A state with an `initial` child is a
+// composite state, entered by descending into that child (or, if it has
+// history, into the child or leaf that was active when it was last
+// exited). Transitions left as 0 are inherited from the nearest ancestor
+// that has one.
+struct hierarchical_machine {
+    int curr_state;
+    int (*map)(const void *);
+    int parent[MAX_STATES];
+    int initial[MAX_STATES];
+    int history[MAX_STATES];
+    int state_table[MAX_STATES][MAX_ALPHABET_SIZE + 1];
+};
+
+// One flattened state: a leaf plus what each history state remembers
+struct stately_configuration {
+    int leaf;
+    int remembered[STATELY_MAX_HISTORY];
+};
+
+static inline int stately_is_ancestor(const struct hierarchical_machine *h, int ancestor, int state)
+{
+    for (int s = state; s; s = h->parent[s]) {
+        if (s == ancestor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int stately_resolve_leaf(const struct hierarchical_machine *h, const int *with_history, int count,
+                                       const struct stately_configuration *config, int state)
+{
+    while (h->initial[state]) {
+        int next = h->initial[state];
+        for (int k = 0; k < count; k++) {
+            if (with_history[k] == state && config->remembered[k]) {
+                next = config->remembered[k];
+            }
+        }
+        state = next;
+    }
+    return state;
+}
+
+// Flattens a hierarchical machine into `out`, whose map() is the same.
+// Every reachable combination of leaf state and history contents becomes
+// one flat state; the first one found for each leaf keeps the leaf's own
+// number, and leaf_of[] (if not NULL) gives the leaf of every flat state.
+// Transitions are local: exiting a leaf records history in the ancestors
+// that are not also ancestors of the target. Returns the number of flat
+// states, or -1 if they do not fit in MAX_STATES (or there are more than
+// STATELY_MAX_HISTORY states with history).
+static inline int stately_flatten(struct state_machine *out, int leaf_of[MAX_STATES], const struct hierarchical_machine *h)
+{
+    struct stately_configuration *configs = (struct stately_configuration *)calloc(MAX_STATES, sizeof(*configs));
+    int *ids = (int *)malloc(MAX_STATES * sizeof(*ids));
+    int with_history[STATELY_MAX_HISTORY], history_count = 0, count = 2, next_id = 0;
+    if (!configs || !ids) {
+        free(configs);
+        free(ids);
+        return -1;
+    }
+    for (int s = 0; s < MAX_STATES; s++) {
+        if (h->history[s] && h->initial[s]) {
+            if (history_count == STATELY_MAX_HISTORY) {
+                free(configs);
+                free(ids);
+                return -1;
+            }
+            with_history[history_count++] = s;
+        }
+        if (s >= next_id && (h->initial[s] || h->parent[s] || s == h->curr_state)) {
+            next_id = s + 1;
+        }
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            if (h->state_table[s][c] >= next_id) {
+                next_id = h->state_table[s][c] + 1;
+            }
+        }
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->map = h->map;
+    configs[1].leaf = stately_resolve_leaf(h, with_history, history_count, &configs[0], h->curr_state);
+    ids[0] = 0;
+    ids[1] = configs[1].leaf;
+    out->curr_state = ids[1];
+
+    for (int i = 1; i < count; i++) {
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            int from = configs[i].leaf, target = 0, found = -1;
+            for (int s = from; s && !target; s = h->parent[s]) {
+                target = h->state_table[s][c];
+            }
+            if (target <= 0) {
+                continue;
+            }
+
+            struct stately_configuration next = configs[i];
+            for (int k = 0; k < history_count; k++) {
+                int a = with_history[k];
+                if (a != from && stately_is_ancestor(h, a, from) && !stately_is_ancestor(h, a, target)) {
+                    int child = from;
+                    while (h->history[a] == SHALLOW_HISTORY && h->parent[child] != a) {
+                        child = h->parent[child];
+                    }
+                    next.remembered[k] = child;
+                }
+            }
+            next.leaf = stately_resolve_leaf(h, with_history, history_count, &next, target);
+            for (int k = 0; k < history_count; k++) {
+                if (stately_is_ancestor(h, with_history[k], next.leaf)) {
+                    next.remembered[k] = 0;
+                }
+            }
+
+            for (int j = 1; j < count && found < 0; j++) {
+                if (!memcmp(&configs[j], &next, sizeof(next))) {
+                    found = j;
+                }
+            }
+            if (found < 0) {
+                int id = next.leaf;
+                for (int j = 1; j < count; j++) {
+                    if (ids[j] == id) {
+                        id = next_id++;
+                        break;
+                    }
+                }
+                if (count == MAX_STATES || id >= MAX_STATES) {
+                    free(configs);
+                    free(ids);
+                    return -1;
+                }
+                found = count++;
+                configs[found] = next;
+                ids[found] = id;
+            }
+            out->state_table[ids[i]][c] = ids[found];
+        }
+    }
+
+    if (leaf_of) {
+        memset(leaf_of, 0, MAX_STATES * sizeof(*leaf_of));
+        for (int i = 0; i < count; i++) {
+            leaf_of[ids[i]] = configs[i].leaf;
+        }
+    }
+    free(configs);
+    free(ids);
+    return count;
+}
+
+// Tags on transitions, for capturing sub-matches while the machine runs.
+// Taking a transition tagged TAG_START(group) records the offset of the
+// input being fed in registers[2 * group]; TAG_END(group) records the
+// offset just past it in registers[2 * group + 1].
+#define TAG_START(group) (1u << (2 * (group)))
+#define TAG_END(group) (1u << (2 * (group) + 1))
+#define MAX_TAGS 32
+
+struct tag_table {
+    unsigned int tags[MAX_STATES][MAX_ALPHABET_SIZE + 1];
+};
+
+static inline void stately_record_tags(unsigned int tags, size_t offset, size_t registers[MAX_TAGS])
+{
+    for (int t = 0; tags; t++, tags >>= 1) {
+        if (tags & 1) {
+            registers[t] = offset + (size_t)(t & 1);
+        }
+    }
+}
+
+// Feeds `count` inputs of `size` bytes each to the machine (like qsort's
+// base/nmemb/size), recording tagged offsets in `registers` (registers
+// that are never tagged are left alone). Returns the final state.
+static inline int stately_run_tagged(struct state_machine *machine, const struct tag_table *tags,
+                                     const void *inputs, size_t size, size_t count, size_t registers[MAX_TAGS])
+{
+    const char *p = (const char *)inputs;
+    int state = machine->curr_state;
+    for (size_t i = 0; i < count; i++, p += size) {
+        int symbol = machine->map(p);
+        unsigned int tagged = tags->tags[state][symbol];
+        if (tagged) {
+            stately_record_tags(tagged, i, registers);
+        }
+        state = machine->state_table[state][symbol];
+    }
+    return machine->curr_state = state;
+}
+
+// stately_scan() with tags, for `char` input
+static inline int stately_scan_tagged(const struct compiled_machine *cm, const struct tag_table *tags, int state,
+                                      const void *bytes, size_t len, size_t registers[MAX_TAGS])
+{
+    unsigned char symbols[STATELY_BATCH_SIZE];
+    const unsigned char *p = (const unsigned char *)bytes;
+    for (size_t first = 0; first < len; first += STATELY_BATCH_SIZE) {
+        size_t n = len - first < STATELY_BATCH_SIZE ? len - first : STATELY_BATCH_SIZE;
+        stately_classify(&cm->classifier, p + first, n, symbols);
+        for (size_t i = 0; i < n; i++) {
+            unsigned int tagged = tags->tags[state][symbols[i]];
+            if (tagged) {
+                stately_record_tags(tagged, first + i, registers);
+            }
+            state = cm->machine->state_table[state][symbols[i]];
+        }
+    }
+    return state;
+}
+
+// A transition on every code point in [lo, hi]
+struct codepoint_transition {
+    int from;
+    unsigned long lo;
+    unsigned long hi;
+    int to;
+};
+
+// Byte mapper for machines over raw bytes, such as stately_compile_utf8()'s
+static inline int stately_map_byte(const void *byte)
+{
+    return *(const unsigned char *)byte;
+}
+
+// A UTF-8 encoded range: every byte between lo[i] and hi[i], in order
+struct utf8_sequence {
+    int from;
+    int to;
+    int len;
+    unsigned char lo[4];
+    unsigned char hi[4];
+};
+
+static inline int stately_utf8_encode(unsigned long cp, unsigned char out[4])
+{
+    if (cp < 0x80) {
+        out[0] = (unsigned char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (unsigned char)(0xc0 | cp >> 6);
+        out[1] = (unsigned char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (unsigned char)(0xe0 | cp >> 12);
+        out[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+        out[2] = (unsigned char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (unsigned char)(0xf0 | cp >> 18);
+    out[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3f));
+    out[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+    out[3] = (unsigned char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+// Splits the scalar values in [lo, hi] (surrogates and anything past
+// U+10FFFF are left out) into UTF-8 byte-range sequences, appending them
+// to *seqs. Returns the new number of sequences, or -1 if out of memory.
+static inline int stately_utf8_split(const struct codepoint_transition *t, struct utf8_sequence **seqs, int count, int *capacity)
+{
+    unsigned long stack[64][2];
+    int top = 0;
+    stack[top][0] = t->lo;
+    stack[top++][1] = t->hi > 0x10ffff ? 0x10ffff : t->hi;
+    while (top) {
+        unsigned long lo = stack[--top][0], hi = stack[top][1];
+        int split = 0;
+        if (lo > hi) {
+            continue;
+        }
+        if (lo <= 0xdfff && hi >= 0xd800) {
+            stack[top][0] = lo, stack[top++][1] = 0xd7ff;
+            stack[top][0] = 0xe000, stack[top++][1] = hi;
+            continue;
+        }
+        static const unsigned long limits[] = { 0x7f, 0x7ff, 0xffff };
+        for (int k = 0; k < 3 && !split; k++) {
+            if (lo <= limits[k] && hi > limits[k]) {
+                stack[top][0] = lo, stack[top++][1] = limits[k];
+                stack[top][0] = limits[k] + 1, stack[top++][1] = hi;
+                split = 1;
+            }
+        }
+        unsigned char elo[4], ehi[4];
+        int len = stately_utf8_encode(lo, elo);
+        for (int i = 1; i < len && !split; i++) {
+            unsigned long m = (1ul << (6 * i)) - 1;
+            if ((lo & ~m) != (hi & ~m)) {
+                if (lo & m) {
+                    stack[top][0] = lo, stack[top++][1] = lo | m;
+                    stack[top][0] = (lo | m) + 1, stack[top++][1] = hi;
+                    split = 1;
+                } else if ((hi & m) != m) {
+                    stack[top][0] = lo, stack[top++][1] = (hi & ~m) - 1;
+                    stack[top][0] = hi & ~m, stack[top++][1] = hi;
+                    split = 1;
+                }
+            }
+        }
+        if (split) {
+            continue;
+        }
+        (void)stately_utf8_encode(hi, ehi);
+        if (count == *capacity) {
+            int grown = *capacity ? 2 * *capacity : 64;
+            struct utf8_sequence *more = (struct utf8_sequence *)realloc(*seqs, (size_t)grown * sizeof(*more));
+            if (!more) {
+                return -1;
+            }
+            *seqs = more;
+            *capacity = grown;
+        }
+        (*seqs)[count].from = t->from;
+        (*seqs)[count].to = t->to;
+        (*seqs)[count].len = len;
+        memcpy((*seqs)[count].lo, elo, 4);
+        memcpy((*seqs)[count].hi, ehi, 4);
+        count++;
+    }
+    return count;
+}
+
+// An in-progress UTF-8 sequence: the rest of sequence `seq` from byte `pos`
+struct utf8_item {
+    int seq;
+    int pos;
+};
+
+static inline int stately_utf8_same_suffix(const struct utf8_sequence *a, int apos, const struct utf8_sequence *b, int bpos)
+{
+    if (a->to != b->to || a->len - apos != b->len - bpos) {
+        return 0;
+    }
+    for (int k = 0; k < a->len - apos; k++) {
+        if (a->lo[apos + k] != b->lo[bpos + k] || a->hi[apos + k] != b->hi[bpos + k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Every item of `a` has a matching suffix in `b`
+static inline int stately_utf8_covers(const struct utf8_sequence *seqs, const struct utf8_item *a, int na, const struct utf8_item *b, int nb)
+{
+    for (int i = 0; i < na; i++) {
+        int found = 0;
+        for (int j = 0; j < nb && !found; j++) {
+            found = stately_utf8_same_suffix(&seqs[a[i].seq], a[i].pos, &seqs[b[j].seq], b[j].pos);
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Compiles transitions over code point ranges into a machine over bytes
+// (with stately_map_byte() as its map()). The states named in the
+// transitions keep their numbers and the states in the middle of a
+// multi-byte sequence are numbered after them, shared between sequences
+// with the same remaining bytes and target. Anything that is not
+// well-formed UTF-8 (overlong forms, surrogates, stray continuation bytes,
+// code points past U+10FFFF) goes to TRAP, so scanning validates the
+// encoding as a side effect. Returns the number of states, or -1 if
+// transitions out of the same state overlap, there are more than
+// MAX_STATES states or MAX_ALPHABET_SIZE is too small for raw bytes.
+static inline int stately_compile_utf8(struct state_machine *out, const struct codepoint_transition *transitions, size_t count, int start)
+{
+    struct utf8_sequence *seqs = NULL;
+    struct utf8_item *items = NULL, *scratch = NULL;
+    int *node_first = NULL, *node_count = NULL;
+    int seq_count = 0, seq_capacity = 0, item_count = 0, item_capacity = 0, states = start + 1, named, result = -1;
+
+    if (MAX_ALPHABET_SIZE < 255) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (transitions[i].from >= states) {
+            states = transitions[i].from + 1;
+        }
+        if (transitions[i].to >= states) {
+            states = transitions[i].to + 1;
+        }
+        if ((seq_count = stately_utf8_split(&transitions[i], &seqs, seq_count, &seq_capacity)) < 0) {
+            goto done;
+        }
+    }
+
+    node_first = (int *)malloc(MAX_STATES * sizeof(*node_first));
+    node_count = (int *)calloc(MAX_STATES, sizeof(*node_count));
+    item_capacity = seq_count * 4 + 1;    // a first guess, grown as nodes are added
+    items = (struct utf8_item *)malloc((size_t)item_capacity * sizeof(*items));
+    scratch = (struct utf8_item *)malloc((size_t)(seq_count + 1) * sizeof(*scratch));
+    if (!node_first || !node_count || !items || !scratch || states > MAX_STATES) {
+        goto done;
+    }
+
+    // The named states start with every sequence leaving them
+    for (int s = 0; s < states; s++) {
+        node_first[s] = item_count;
+        for (int q = 0; q < seq_count; q++) {
+            if (seqs[q].from == s) {
+                items[item_count].seq = q;
+                items[item_count++].pos = 0;
+                node_count[s]++;
+            }
+        }
+    }
+
+    named = states;
+    memset(out, 0, sizeof(*out));
+    out->map = stately_map_byte;
+    out->curr_state = start;
+
+    for (int node = 0; node < states; node++) {
+        for (int b = 0; b < 256; b++) {
+            int matched = 0, to = -1, complete = 0, found = -1;
+            for (int k = node_first[node]; k < node_first[node] + node_count[node]; k++) {
+                const struct utf8_sequence *q = &seqs[items[k].seq];
+                int pos = items[k].pos;
+                if (b < q->lo[pos] || b > q->hi[pos]) {
+                    continue;
+                }
+                if (pos + 1 == q->len) {
+                    if (to >= 0 && to != q->to) {
+                        goto done;
+                    }
+                    to = q->to;
+                    complete = 1;
+                } else {
+                    scratch[matched].seq = items[k].seq;
+                    scratch[matched++].pos = pos + 1;
+                }
+            }
+            if (complete) {
+                if (matched) {
+                    goto done;
+                }
+                out->state_table[node][b] = to;
+                continue;
+            }
+            if (!matched) {
+                continue;
+            }
+            for (int other = named; other < states && found < 0; other++) {
+                if (stately_utf8_covers(seqs, scratch, matched, items + node_first[other], node_count[other]) &&
+                    stately_utf8_covers(seqs, items + node_first[other], node_count[other], scratch, matched)) {
+                    found = other;
+                }
+            }
+            if (found < 0) {
+                if (states == MAX_STATES) {
+                    goto done;
+                }
+                if (item_count + matched > item_capacity) {
+                    int grown = 2 * item_capacity > item_count + matched ? 2 * item_capacity : item_count + matched;
+                    struct utf8_item *more = (struct utf8_item *)realloc(items, (size_t)grown * sizeof(*more));
+                    if (!more) {
+                        goto done;
+                    }
+                    items = more;
+                    item_capacity = grown;
+                }
+                found = states++;
+                node_first[found] = item_count;
+                node_count[found] = matched;
+                memcpy(items + item_count, scratch, (size_t)matched * sizeof(*items));
+                item_count += matched;
+            }
+            out->state_table[node][b] = found;
+        }
+    }
+    result = states;
+
+done:
+    free(seqs);
+    free(items);
+    free(scratch);
+    free(node_first);
+    free(node_count);
+    return result;
+}
+
+#ifndef STATELY_PAGE_BITS
+# define STATELY_PAGE_BITS 8
+#endif
+
+#define STATELY_PAGE_SIZE (1ul << STATELY_PAGE_BITS)
+
+// Every symbol in [lo, hi] belongs to symbol class `symbol`
+struct symbol_range {
+    unsigned long lo;
+    unsigned long hi;
+    int symbol;
+};
+
+// Two-level symbol -> class lookup for alphabets too big for a state_table
+// row. The top bits of a symbol pick a page through the directory and the
+// bottom STATELY_PAGE_BITS pick the class within it. Identical pages are
+// only stored once, so memory grows with the number of distinct behaviors
+// rather than with the size of the alphabet.
+struct symbol_table {
+    unsigned long range;
+    unsigned int *directory;
+    unsigned short *pages;
+    unsigned int page_count;
+};
+
+// Builds the table for symbols [0, range). Symbols not covered by any of
+// the ranges (and anything past `range`) are class 0 (INVALID), and where
+// ranges overlap the later one wins. Fails if a class does not fit in a
+// state_table row or if out of memory.
+static inline int stately_symbols_init(struct symbol_table *table, const struct symbol_range *ranges, size_t count, unsigned long range)
+{
+    unsigned long directory_size = (range + STATELY_PAGE_SIZE - 1) >> STATELY_PAGE_BITS;
+    unsigned int capacity = 4;
+    unsigned short page[STATELY_PAGE_SIZE];
+
+    memset(table, 0, sizeof(*table));
+    for (size_t i = 0; i < count; i++) {
+        if (ranges[i].symbol < 0 || ranges[i].symbol > MAX_ALPHABET_SIZE) {
+            return -1;
+        }
+    }
+
+    table->range = range;
+    table->directory = (unsigned int *)malloc((directory_size ? directory_size : 1) * sizeof(*table->directory));
+    table->pages = (unsigned short *)malloc(capacity * STATELY_PAGE_SIZE * sizeof(*table->pages));
+    if (!table->directory || !table->pages) {
+        goto fail;
+    }
+
+    for (unsigned long d = 0; d < directory_size; d++) {
+        unsigned long first = d << STATELY_PAGE_BITS, last = first + STATELY_PAGE_SIZE - 1;
+        unsigned int p;
+
+        memset(page, 0, sizeof(page));
+        for (size_t i = 0; i < count; i++) {
+            if (ranges[i].hi < first || ranges[i].lo > last) {
+                continue;
+            }
+            unsigned long lo = ranges[i].lo < first ? first : ranges[i].lo;
+            unsigned long hi = ranges[i].hi > last ? last : ranges[i].hi;
+            for (unsigned long s = lo; s <= hi; s++) {
+                page[s - first] = (unsigned short)ranges[i].symbol;
+            }
+        }
+
+        // Most pages look like one we already have
+        for (p = 0; p < table->page_count; p++) {
+            if (!memcmp(table->pages + p * STATELY_PAGE_SIZE, page, sizeof(page))) {
+                break;
+            }
+        }
+        if (p == table->page_count) {
+            if (p == capacity) {
+                unsigned short *more = (unsigned short *)realloc(table->pages, 2 * capacity * STATELY_PAGE_SIZE * sizeof(*more));
+                if (!more) {
+                    goto fail;
+                }
+                table->pages = more;
+                capacity *= 2;
+            }
+            memcpy(table->pages + p * STATELY_PAGE_SIZE, page, sizeof(page));
+            table->page_count++;
+        }
+        table->directory[d] = p;
+    }
+    return 0;
+
+fail:
+    free(table->directory);
+    free(table->pages);
+    memset(table, 0, sizeof(*table));
+    return -1;
+}
+
+static inline void stately_symbols_free(struct symbol_table *table)
+{
+    free(table->directory);
+    free(table->pages);
+    memset(table, 0, sizeof(*table));
+}
+
+// Class of a symbol, for use in map() and map_batch()
+static inline int stately_symbol_class(const struct symbol_table *table, unsigned long symbol)
+{
+    if (symbol >= table->range) {
+        return 0;
+    }
+    return table->pages[(size_t)table->directory[symbol >> STATELY_PAGE_BITS] * STATELY_PAGE_SIZE + (symbol & (STATELY_PAGE_SIZE - 1))];
+}
+
+// Bytes the table takes up, for when someone asks why not just use a
+// bigger MAX_ALPHABET_SIZE
+static inline size_t stately_symbols_size(const struct symbol_table *table)
+{
+    size_t directory_size = (table->range + STATELY_PAGE_SIZE - 1) >> STATELY_PAGE_BITS;
+    return directory_size * sizeof(*table->directory) + table->page_count * STATELY_PAGE_SIZE * sizeof(*table->pages);
+}
+
+// States a compiled machine was in at points along a buffer, so that the
+// buffer can be re-validated after an edit without starting over.
+// Checkpoint i is the state after the first offsets[i] bytes.
+struct scan_checkpoints {
+    size_t interval;
+    size_t *offsets;
+    int *states;
+    size_t count;
+    size_t capacity;
+    size_t length;
+    int final;
+    size_t rescanned;
+};
+
+static inline void stately_checkpoints_free(struct scan_checkpoints *cp)
+{
+    free(cp->offsets);
+    free(cp->states);
+    memset(cp, 0, sizeof(*cp));
+}
+
+static inline int stately_checkpoint(struct scan_checkpoints *cp, size_t offset, int state)
+{
+    if (cp->count == cp->capacity) {
+        size_t grown = cp->capacity ? 2 * cp->capacity : 64;
+        size_t *offsets = (size_t *)realloc(cp->offsets, grown * sizeof(*offsets));
+        if (!offsets) {
+            return -1;
+        }
+        cp->offsets = offsets;
+        int *states = (int *)realloc(cp->states, grown * sizeof(*states));
+        if (!states) {
+            return -1;
+        }
+        cp->states = states;
+        cp->capacity = grown;
+    }
+    cp->offsets[cp->count] = offset;
+    cp->states[cp->count++] = state;
+    return 0;
+}
+
+// Scans `len` bytes from `state` like stately_scan(), recording a
+// checkpoint every `interval` bytes. Returns the final state, or -1 if out
+// of memory.
+static inline int stately_scan_checkpointed(struct scan_checkpoints *cp, size_t interval, const struct compiled_machine *cm,
+                                            int state, const void *bytes, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    cp->interval = interval ? interval : 1;
+    cp->count = 0;
+    if (stately_checkpoint(cp, 0, state)) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; ) {
+        size_t n = len - i < cp->interval ? len - i : cp->interval;
+        state = stately_scan(cm, state, p + i, n);
+        i += n;
+        if (i < len && stately_checkpoint(cp, i, state)) {
+            return -1;
+        }
+    }
+    cp->length = len;
+    cp->rescanned = len;
+    return cp->final = state;
+}
+
+// Re-validates a buffer after the `removed` bytes at `offset` were
+// replaced by `inserted` new ones (`bytes` and `len` are the buffer after
+// the edit). Scanning resumes from the last checkpoint before the edit and
+// stops as soon as the machine is back in the state recorded at one of the
+// old checkpoints after it, since everything from there on is unchanged;
+// the remaining checkpoints are just moved over. Returns the final state,
+// or -1 if out of memory, and leaves the number of bytes actually scanned
+// in `rescanned`.
+static inline int stately_rescan(struct scan_checkpoints *cp, const struct compiled_machine *cm, const void *bytes, size_t len,
+                                 size_t offset, size_t removed, size_t inserted)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    size_t lo = 0, hi = cp->count, tail, tail_count, i, t;
+    size_t *tail_offsets;
+    int *tail_states;
+    int state, result = -1;
+
+    // Last checkpoint at or before the edit
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cp->offsets[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // First checkpoint past the edit, in old offsets
+    for (tail = lo + 1; tail < cp->count && cp->offsets[tail] < offset + removed; tail++) {
+    }
+    tail_count = cp->count - tail;
+    tail_offsets = (size_t *)malloc((tail_count ? tail_count : 1) * sizeof(*tail_offsets));
+    tail_states = (int *)malloc((tail_count ? tail_count : 1) * sizeof(*tail_states));
+    if (!tail_offsets || !tail_states) {
+        goto done;
+    }
+    for (size_t k = 0; k < tail_count; k++) {
+        tail_offsets[k] = cp->offsets[tail + k] - removed + inserted;
+        tail_states[k] = cp->states[tail + k];
+    }
+
+    i = cp->offsets[lo];
+    t = 0;
+    state = cp->states[lo];
+    cp->count = lo + 1;
+    cp->rescanned = 0;
+    while (i < len) {
+        size_t next = i + cp->interval < len ? i + cp->interval : len;
+        while (t < tail_count && tail_offsets[t] <= i) {
+            t++;
+        }
+        if (t < tail_count && tail_offsets[t] < next) {
+            next = tail_offsets[t];
+        }
+        state = stately_scan(cm, state, p + i, next - i);
+        cp->rescanned += next - i;
+        i = next;
+
+        if (t < tail_count && tail_offsets[t] == i && tail_states[t] == state) {
+            for (; t < tail_count; t++) {
+                if (stately_checkpoint(cp, tail_offsets[t], tail_states[t])) {
+                    goto done;
+                }
+            }
+            cp->length = len;
+            result = state = cp->final;
+            goto done;
+        }
+        if (i < len && i - cp->offsets[cp->count - 1] >= cp->interval && stately_checkpoint(cp, i, state)) {
+            goto done;
+        }
+    }
+    cp->length = len;
+    result = cp->final = state;
+
+done:
+    free(tail_offsets);
+    free(tail_states);
+    return result;
+}
+
+// One slot of a packed_machine: `next` belongs to state `check`
+struct packed_cell {
+    int check;
+    int next;
+};
+
+// Row-displacement ("comb vector") form of a state_machine, as used for
+// yacc/bison parser tables. Every row is stored only by its non-TRAP
+// transitions, overlaid on the other rows at offset base[state], and a
+// cell whose `check` names some other state means TRAP. A lookup is still
+// two loads (base, then the cell), but the table shrinks from
+// MAX_STATES * (MAX_ALPHABET_SIZE + 1) ints to roughly two per transition.
+struct packed_machine {
+    int curr_state;
+    int (*map)(const void *);
+    int states;
+    int *base;
+    struct packed_cell *cells;
+    size_t cell_count;
+};
+
+static inline void stately_packed_free(struct packed_machine *pm)
+{
+    free(pm->base);
+    free(pm->cells);
+    memset(pm, 0, sizeof(*pm));
+}
+
+// Packs states [0, states) of a table with rows `stride` ints apart.
+// Rows are placed densest first, each at the lowest offset where its
+// transitions only land on free cells. Returns 0, or -1 if out of memory.
+static inline int stately_pack_table(struct packed_machine *pm, const int *table, size_t stride, int states)
+{
+    size_t capacity = 4 * stride, first_free = 0;
+    size_t *buckets = (size_t *)calloc(stride + 1, sizeof(*buckets));
+    int *order = (int *)malloc((size_t)(states ? states : 1) * sizeof(*order));
+    int *counts = (int *)malloc((size_t)(states ? states : 1) * sizeof(*counts));
+    int *columns = (int *)malloc(stride * sizeof(*columns));
+    int result = -1;
+
+    pm->states = states;
+    pm->cell_count = 0;
+    pm->base = (int *)calloc((size_t)(states ? states : 1), sizeof(*pm->base));
+    pm->cells = (struct packed_cell *)malloc(capacity * sizeof(*pm->cells));
+    if (!buckets || !order || !counts || !columns || !pm->base || !pm->cells) {
+        goto done;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        pm->cells[i].check = -1;
+        pm->cells[i].next = 0;
+    }
+
+    // Counting sort by number of transitions, most first
+    for (int s = 0; s < states; s++) {
+        counts[s] = 0;
+        for (size_t c = 0; c < stride; c++) {
+            counts[s] += table[(size_t)s * stride + c] != 0;
+        }
+        buckets[stride - (size_t)counts[s]]++;
+    }
+    for (size_t k = 1; k <= stride; k++) {
+        buckets[k] += buckets[k - 1];
+    }
+    for (int s = states - 1; s >= 0; s--) {
+        order[--buckets[stride - (size_t)counts[s]]] = s;
+    }
+
+    for (int k = 0; k < states; k++) {
+        int s = order[k], n = 0;
+        const int *row = table + (size_t)s * stride;
+        for (size_t c = 0; c < stride; c++) {
+            if (row[c]) {
+                columns[n++] = (int)c;
+            }
+        }
+        if (!n) {
+            continue;
+        }
+
+        size_t d = first_free > (size_t)columns[0] ? first_free - (size_t)columns[0] : 0;
+        for (;; d++) {
+            int fits = 1;
+            if (d + stride > capacity) {
+                struct packed_cell *more = (struct packed_cell *)realloc(pm->cells, 2 * capacity * sizeof(*more));
+                if (!more) {
+                    goto done;
+                }
+                pm->cells = more;
+                for (size_t i = capacity; i < 2 * capacity; i++) {
+                    pm->cells[i].check = -1;
+                    pm->cells[i].next = 0;
+                }
+                capacity *= 2;
+            }
+            for (int j = 0; j < n && fits; j++) {
+                fits = pm->cells[d + (size_t)columns[j]].check < 0;
+            }
+            if (fits) {
+                break;
+            }
+        }
+
+        pm->base[s] = (int)d;
+        for (int j = 0; j < n; j++) {
+            pm->cells[d + (size_t)columns[j]].check = s;
+            pm->cells[d + (size_t)columns[j]].next = row[columns[j]];
+        }
+        if (d + stride > pm->cell_count) {
+            pm->cell_count = d + stride;
+        }
+        while (first_free < capacity && pm->cells[first_free].check >= 0) {
+            first_free++;
+        }
+    }
+
+    // Every lookup stays inside the array, even for rows that were empty
+    if (pm->cell_count < stride) {
+        pm->cell_count = stride;
+    }
+    result = 0;
+
+done:
+    free(buckets);
+    free(order);
+    free(counts);
+    free(columns);
+    if (result) {
+        stately_packed_free(pm);
+    }
+    return result;
+}
+
+// Packs the states of `machine` that are in use
+static inline int stately_pack(struct packed_machine *pm, const struct state_machine *machine)
+{
+    memset(pm, 0, sizeof(*pm));
+    pm->curr_state = machine->curr_state;
+    pm->map = machine->map;
+    return stately_pack_table(pm, &machine->state_table[0][0], MAX_ALPHABET_SIZE + 1, stately_state_count(machine));
+}
+
+static inline int stately_packed_step(const struct packed_machine *pm, int state, int symbol)
+{
+    // States past the packed ones (say, a start state set after packing
+    // that nothing leads into) have no transitions
+    if (state >= pm->states) {
+        return 0;
+    }
+    const struct packed_cell *cell = &pm->cells[pm->base[state] + symbol];
+    return cell->check == state ? cell->next : 0;
+}
+
+// GET_NEXT_STATE() for a packed_machine
+static inline int stately_packed_next(struct packed_machine *pm, const void *input)
+{
+    return pm->curr_state = stately_packed_step(pm, pm->curr_state, pm->map(input));
+}
+
+// Feeds `count` inputs of `size` bytes each to the machine (like qsort's
+// base/nmemb/size) and returns the final state
+static inline int stately_packed_run(struct packed_machine *pm, const void *inputs, size_t size, size_t count)
+{
+    const char *p = (const char *)inputs;
+    int state = pm->curr_state;
+    for (size_t i = 0; i < count; i++, p += size) {
+        state = stately_packed_step(pm, state, pm->map(p));
+    }
+    return pm->curr_state = state;
+}
+
+// stately_run_bytes() for a packed_machine
+static inline int stately_packed_run_bytes(struct packed_machine *pm, const struct byte_classifier *cls, const void *bytes, size_t len)
+{
+    unsigned char symbols[STATELY_BATCH_SIZE];
+    const unsigned char *p = (const unsigned char *)bytes;
+    int state = pm->curr_state;
+    for (size_t first = 0; first < len; first += STATELY_BATCH_SIZE) {
+        size_t n = len - first < STATELY_BATCH_SIZE ? len - first : STATELY_BATCH_SIZE;
+        stately_classify(cls, p + first, n, symbols);
+        for (size_t i = 0; i < n; i++) {
+            state = stately_packed_step(pm, state, symbols[i]);
+        }
+    }
+    return pm->curr_state = state;
+}
+
+// Feeds a chain of buffers to the machine as if they were one, classifying
+// bytes with `cls`. Returns the final state.
+static inline int stately_run_iov(struct state_machine *machine, const struct byte_classifier *cls, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        (void)stately_run_bytes(machine, cls, iov[i].iov_base, iov[i].iov_len);
+    }
+    return machine->curr_state;
+}
+
+// stately_scan() across a chain of buffers, carrying the state over from
+// one to the next
+static inline int stately_scan_iov(const struct compiled_machine *cm, int state, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        state = stately_scan(cm, state, iov[i].iov_base, iov[i].iov_len);
+    }
+    return state;
+}
+
+// A position in a chain of buffers: byte `offset` of iov[segment], which is
+// byte `global` of the whole chain
+struct iov_cursor {
+    int segment;
+    size_t offset;
+    size_t global;
+};
+
+// Moves a cursor forward `n` bytes, skipping over empty buffers
+static inline void stately_iov_advance(const struct iovec *iov, int iovcnt, struct iov_cursor *at, size_t n)
+{
+    at->global += n;
+    n += at->offset;
+    while (at->segment < iovcnt && n >= iov[at->segment].iov_len) {
+        n -= iov[at->segment].iov_len;
+        at->segment++;
+    }
+    at->offset = n;
+}
+
+// stately_match_longest() starting at `at` and reading on into the
+// following buffers as long as the machine hasn't trapped
+static inline size_t stately_iov_match_longest(const struct compiled_machine *cm, const struct iovec *iov, int iovcnt,
+                                               struct iov_cursor at)
+{
+    const struct state_machine *machine = cm->machine;
+    int state = cm->start;
+    size_t length = 0, end = 0;
+    for (int i = at.segment; i < iovcnt; i++) {
+        const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+        size_t len = iov[i].iov_len, j = i == at.segment ? at.offset : 0, first = j;
+        while (j < len) {
+            state = machine->state_table[state][cm->classifier.classes[p[j++]]];
+            if (state == 0) {
+                return end;
+            }
+            if (cm->loops[state].count) {
+                j += stately_ranges_span(&cm->loops[state], p + j, len - j);
+            }
+            if (cm->accepting[state]) {
+                end = length + j - first;
+            }
+        }
+        length += len - first;
+    }
+    return end;
+}
+
+// stately_search() across a chain of buffers, without copying them
+// together first. Matches may span buffers, and are reported as offsets
+// into the whole chain.
+static inline size_t stately_search_iov(const struct compiled_machine *cm, const struct iovec *iov, int iovcnt,
+                                        int (*on_match)(size_t, size_t, void *), void *ctx)
+{
+    struct iov_cursor at = { 0, 0, 0 };
+    size_t matches = 0;
+    stately_iov_advance(iov, iovcnt, &at, 0);
+    while (at.segment < iovcnt) {
+        const unsigned char *p = (const unsigned char *)iov[at.segment].iov_base;
+        size_t len = iov[at.segment].iov_len;
+        size_t skip = stately_prefilter(cm, p + at.offset, len - at.offset);
+        if (at.offset + skip >= len) {
+            stately_iov_advance(iov, iovcnt, &at, len - at.offset);
+            continue;
+        }
+        stately_iov_advance(iov, iovcnt, &at, skip);
+        size_t end = stately_iov_match_longest(cm, iov, iovcnt, at);
+        if (!end) {
+            stately_iov_advance(iov, iovcnt, &at, 1);
+            continue;
+        }
+        matches++;
+        if (on_match && on_match(at.global, at.global + end, ctx)) {
+            break;
+        }
+        stately_iov_advance(iov, iovcnt, &at, end);
+    }
+    return matches;
+}
+
+// Bit-parallel (Shift-And) form of one or more acyclic machines. Every
+// string a machine accepts follows one path through it, and every path of
+// length n gets n consecutive bits of a 64-bit word, one per position.
+// masks[byte] has the bits of the positions that byte can be at, so a step
+// is a shift, an OR and an AND on the set of live positions, and the whole
+// engine is a 2 KB table.
+struct shift_and {
+    unsigned long long masks[256];
+    unsigned long long firsts;
+    unsigned long long lasts;
+    unsigned char lengths[64];
+    int bits;
+    int patterns;
+    int empty;
+};
+
+static inline void stately_shift_and_init(struct shift_and *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+}
+
+// Adds one pattern of `length` positions, where position i matches the
+// bytes b with sets[i][b] set
+static inline int stately_shift_and_pattern(struct shift_and *sa, int length, const unsigned char (*sets)[256])
+{
+    if (length > 64 - sa->bits) {
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        for (int b = 0; b < 256; b++) {
+            if (sets[i][b]) {
+                sa->masks[b] |= 1ull << (sa->bits + i);
+            }
+        }
+    }
+    sa->firsts |= 1ull << sa->bits;
+    sa->lasts |= 1ull << (sa->bits + length - 1);
+    sa->lengths[sa->bits + length - 1] = (unsigned char)length;
+    sa->bits += length;
+    sa->patterns++;
+    return 0;
+}
+
+// Adds a literal string as one more pattern
+static inline int stately_shift_and_add_string(struct shift_and *sa, const char *literal)
+{
+    int length = (int)strlen(literal), result;
+    if (!length) {
+        sa->empty = 1;
+        return 0;
+    }
+    if (length > 64) {
+        return -1;
+    }
+    unsigned char (*sets)[256] = (unsigned char (*)[256])calloc((size_t)length, sizeof(*sets));
+    if (!sets) {
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        sets[i][(unsigned char)literal[i]] = 1;
+    }
+    result = stately_shift_and_pattern(sa, length, (const unsigned char (*)[256])sets);
+    free(sets);
+    return result;
+}
+
+// Adds every path from the start state of `cm` to an accepting state as
+// a pattern. Fails (leaving `sa` partly filled in) if the machine has a
+// cycle or the paths need more than the 64 bits in total.
+static inline int stately_shift_and_add(struct shift_and *sa, const struct compiled_machine *cm)
+{
+    const struct state_machine *machine = cm->machine;
+    unsigned char (*sets)[256] = (unsigned char (*)[256])malloc(64 * sizeof(*sets));
+    int path[65], next[65], depth = 0, explored = 0, result = -1;
+
+    if (!sets) {
+        return -1;
+    }
+    if (cm->accepting[cm->start]) {
+        sa->empty = 1;
+    }
+    path[0] = cm->start;
+    next[0] = 0;
+    while (depth >= 0) {
+        int s = path[depth], t = MAX_STATES;
+
+        // The lowest target above the last one explored from here
+        for (int b = 0; b < 256; b++) {
+            int to = machine->state_table[s][cm->classifier.classes[b]];
+            if (to > next[depth] && to < t) {
+                t = to;
+            }
+        }
+        if (t == MAX_STATES) {
+            depth--;
+            continue;
+        }
+        next[depth] = t;
+
+        // A path longer than 64 positions can't fit, and also catches cycles
+        if (depth == 64 || ++explored > 64 * MAX_STATES) {
+            goto done;
+        }
+        for (int b = 0; b < 256; b++) {
+            sets[depth][b] = machine->state_table[s][cm->classifier.classes[b]] == t;
+        }
+        path[++depth] = t;
+        next[depth] = 0;
+        if (cm->accepting[t] && stately_shift_and_pattern(sa, depth, (const unsigned char (*)[256])sets)) {
+            goto done;
+        }
+    }
+    result = 0;
+
+done:
+    free(sets);
+    return result;
+}
+
+// Steps the set of live positions on one byte. Passing `firsts` as `start`
+// starts a new match at every byte; passing 0 only continues old ones.
+static inline unsigned long long stately_shift_and_step(const struct shift_and *sa, unsigned long long live,
+                                                        unsigned long long start, unsigned char byte)
+{
+    return (((live << 1) & ~sa->firsts) | start) & sa->masks[byte];
+}
+
+// Returns nonzero if some pattern matches all `len` bytes
+static inline int stately_shift_and_run(const struct shift_and *sa, const void *bytes, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    unsigned long long live = 0;
+    if (!len) {
+        return sa->empty;
+    }
+    for (size_t i = 0; i < len && (live || !i); i++) {
+        live = stately_shift_and_step(sa, live, i ? 0 : sa->firsts, p[i]);
+    }
+    return (live & sa->lasts) != 0;
+}
+
+// Reports every non-empty match in `bytes` to on_match() as [start, end)
+// offsets, in order of where they end (longest first for matches that end
+// at the same byte). Unlike stately_search(), overlapping matches are all
+// reported. on_match() may be NULL, or return nonzero to stop the search.
+// Returns the number of matches.
+static inline size_t stately_shift_and_search(const struct shift_and *sa, const void *bytes, size_t len,
+                                              int (*on_match)(size_t, size_t, void *), void *ctx)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+    unsigned long long live = 0;
+    size_t matches = 0;
+    for (size_t i = 0; i < len; i++) {
+        live = stately_shift_and_step(sa, live, sa->firsts, p[i]);
+        unsigned long long hits = live & sa->lasts;
+        while (hits) {
+            unsigned long long rest = hits;
+            int longest = __builtin_ctzll(hits);
+            while (rest) {
+                int bit = __builtin_ctzll(rest);
+                if (sa->lengths[bit] > sa->lengths[longest]) {
+                    longest = bit;
+                }
+                rest &= rest - 1;
+            }
+            hits &= ~(1ull << longest);
+
+            // Other patterns of the same length matched the same bytes
+            for (rest = hits; rest; rest &= rest - 1) {
+                if (sa->lengths[__builtin_ctzll(rest)] == sa->lengths[longest]) {
+                    hits &= ~(rest & -rest);
+                }
+            }
+            matches++;
+            if (on_match && on_match(i + 1 - sa->lengths[longest], i + 1, ctx)) {
+                return matches;
+            }
+        }
+    }
+    return matches;
+}
+
+#ifdef STATELY_THREADS
+#include <sched.h>
+
+#ifndef STATELY_MAX_READERS
+# define STATELY_MAX_READERS 64
+#endif
+
+#ifndef STATELY_MAX_RETIRED
+# define STATELY_MAX_RETIRED 16
+#endif
+
+// The epoch a reader entered at, or 0 while it isn't reading. Each one
+// gets its own cache line so readers never write to a shared one.
+struct stately_reader {
+    unsigned long epoch;
+    char pad[64 - sizeof(unsigned long)];
+};
+
+// A machine that has been swapped out, and the last epoch it was current in
+struct stately_retired {
+    void *machine;
+    unsigned long epoch;
+};
+
+// A machine (of whatever kind) that can be replaced while other threads
+// are scanning with it. Readers announce the epoch they entered at in
+// their own slot and then load the current machine, without taking any
+// locks; a swapped-out machine is only destroyed once no reader is left
+// in an epoch it could have been loaded in.
+struct machine_handle {
+    void *current;
+    unsigned long epoch;
+    struct stately_reader readers[STATELY_MAX_READERS];
+    struct stately_retired retired[STATELY_MAX_RETIRED];
+    int retired_count;
+    void (*destroy)(void *machine, void *ctx);
+    void *ctx;
+    pthread_mutex_t lock;
+};
+
+// Publishes `machine` as the first version. destroy() is called on every
+// version once no reader can be using it any more, and may be NULL.
+static inline int stately_handle_init(struct machine_handle *h, void *machine, void (*destroy)(void *, void *), void *ctx)
+{
+    memset(h, 0, sizeof(*h));
+    h->current = machine;
+    h->epoch = 1;
+    h->destroy = destroy;
+    h->ctx = ctx;
+    return pthread_mutex_init(&h->lock, NULL) ? -1 : 0;
+}
+
+// Starts a scan on reader slot `reader` (one per thread, e.g. its worker
+// index) and returns the machine to scan with. The machine stays valid
+// until stately_handle_exit(), even if it is swapped out in the meantime.
+static inline void *stately_handle_enter(struct machine_handle *h, int reader)
+{
+    unsigned long epoch = __atomic_load_n(&h->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&h->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+}
+
+static inline void stately_handle_exit(struct machine_handle *h, int reader)
+{
+    __atomic_store_n(&h->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Destroys the retired machines no reader can still be using and returns
+// how many are left waiting. Call with the lock held.
+static inline int stately_handle_collect(struct machine_handle *h)
+{
+    unsigned long oldest = (unsigned long)-1;
+    int kept = 0;
+    for (int r = 0; r < STATELY_MAX_READERS; r++) {
+        unsigned long epoch = __atomic_load_n(&h->readers[r].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    for (int i = 0; i < h->retired_count; i++) {
+        if (h->retired[i].epoch < oldest) {
+            if (h->destroy) {
+                h->destroy(h->retired[i].machine, h->ctx);
+            }
+        } else {
+            h->retired[kept++] = h->retired[i];
+        }
+    }
+    return h->retired_count = kept;
+}
+
+static inline int stately_handle_reclaim(struct machine_handle *h)
+{
+    pthread_mutex_lock(&h->lock);
+    int left = stately_handle_collect(h);
+    pthread_mutex_unlock(&h->lock);
+    return left;
+}
+
+// Makes `machine` the current version. Scans that are already running
+// finish on the old one and every stately_handle_enter() from here on gets
+// the new one. Readers are never blocked; if STATELY_MAX_RETIRED old
+// versions are all still in use, the caller waits for a reader to finish.
+static inline void stately_handle_swap(struct machine_handle *h, void *machine)
+{
+    pthread_mutex_lock(&h->lock);
+    while (h->retired_count == STATELY_MAX_RETIRED && stately_handle_collect(h) == STATELY_MAX_RETIRED) {
+        sched_yield();
+    }
+    void *old = __atomic_exchange_n(&h->current, machine, __ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_fetch_add(&h->epoch, 1, __ATOMIC_SEQ_CST);
+
+    // Anyone who loaded `old` announced `epoch` or earlier
+    h->retired[h->retired_count].machine = old;
+    h->retired[h->retired_count++].epoch = epoch;
+    (void)stately_handle_collect(h);
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Waits for every reader to exit, the ones still inside the current version
+// included, and destroys all versions, current one included
+static inline void stately_handle_destroy(struct machine_handle *h)
+{
+    while (stately_handle_reclaim(h)) {
+        sched_yield();
+    }
+    for (int r = 0; r < STATELY_MAX_READERS; r++) {
+        while (__atomic_load_n(&h->readers[r].epoch, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+    if (h->destroy) {
+        h->destroy(h->current, h->ctx);
+    }
+    pthread_mutex_destroy(&h->lock);
+}
+#endif
+
+enum stately_counter {
+    STATELY_CYCLES,
+    STATELY_INSTRUCTIONS,
+    STATELY_CACHE_MISSES,
+    STATELY_BRANCH_MISSES,
+    STATELY_COUNTERS
+};
+
+// What was spent at one call site (or on one machine, if it gets its own
+// site), summed over every call
+struct stately_profile {
+    const char *name;
+    unsigned long long counts[STATELY_COUNTERS];
+    unsigned long long bytes;
+    unsigned long long calls;
+};
+
+// Hardware counters for the calling thread, read as one group
+struct stately_counters {
+    int leader;
+    int fd[STATELY_COUNTERS];
+    int slot[STATELY_COUNTERS];
+    int opened;
+};
+
+#ifdef STATELY_PROFILE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Opens whichever of the counters the kernel lets us have (user space
+// only, so perf_event_paranoid up to 2 is fine). Returns -1 if none.
+static inline int stately_counters_open(struct stately_counters *c)
+{
+    static const unsigned long long configs[STATELY_COUNTERS] = {
+        [STATELY_CYCLES]        = PERF_COUNT_HW_CPU_CYCLES,
+        [STATELY_INSTRUCTIONS]  = PERF_COUNT_HW_INSTRUCTIONS,
+        [STATELY_CACHE_MISSES]  = PERF_COUNT_HW_CACHE_MISSES,
+        [STATELY_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    c->leader = -1;
+    c->opened = 0;
+    for (int k = 0; k < STATELY_COUNTERS; k++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[k];
+        attr.disabled = c->leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        c->fd[k] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, c->leader, 0);
+        if (c->fd[k] >= 0) {
+            c->slot[k] = c->opened++;
+            if (c->leader < 0) {
+                c->leader = c->fd[k];
+            }
+        }
+    }
+    if (c->leader < 0) {
+        return -1;
+    }
+    ioctl(c->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+static inline void stately_counters_close(struct stately_counters *c)
+{
+    for (int k = 0; k < STATELY_COUNTERS; k++) {
+        if (c->fd[k] >= 0) {
+            close(c->fd[k]);
+        }
+    }
+    c->leader = -1;
+    c->opened = 0;
+}
+
+// Current counter values (0 for any that couldn't be opened)
+static inline void stately_counters_read(const struct stately_counters *c, unsigned long long values[STATELY_COUNTERS])
+{
+    unsigned long long group[1 + STATELY_COUNTERS] = { 0 };
+    if (c->leader >= 0 && read(c->leader, group, sizeof(group)) < (ssize_t)sizeof(*group)) {
+        group[0] = 0;
+    }
+    for (int k = 0; k < STATELY_COUNTERS; k++) {
+        values[k] = c->leader >= 0 && c->fd[k] >= 0 && c->slot[k] < (int)group[0] ? group[1 + c->slot[k]] : 0;
+    }
+}
+
+// Adds what was spent since `start` to a call site
+static inline void stately_profile_add(const struct stately_counters *c, struct stately_profile *site,
+                                       const unsigned long long start[STATELY_COUNTERS], size_t bytes)
+{
+    unsigned long long now[STATELY_COUNTERS];
+    stately_counters_read(c, now);
+    for (int k = 0; k < STATELY_COUNTERS; k++) {
+        site->counts[k] += now[k] - start[k];
+    }
+    site->bytes += bytes;
+    site->calls++;
+}
+
+// Runs `call` (any statement, e.g. `state = stately_scan(...)`) and
+// charges it and its `bytes` to `site`
+# define STATELY_PROFILED(counters, site, bytes, call) do { \
+        unsigned long long stately_start_[STATELY_COUNTERS]; \
+        stately_counters_read(counters, stately_start_); \
+        call; \
+        stately_profile_add(counters, site, stately_start_, bytes); \
+    } while (0)
+
+// Prints one line per call site: cycles, instructions, cache and branch
+// misses per byte
+static inline void stately_profile_report(FILE *out, const struct stately_profile *sites, int count)
+{
+    fprintf(out, "%-24s %12s %10s %10s %13s %13s\n", "site", "bytes", "cycles/B", "instr/B", "cache-miss/B", "branch-miss/B");
+    for (int i = 0; i < count; i++) {
+        double bytes = sites[i].bytes ? (double)sites[i].bytes : 1.0;
+        fprintf(out, "%-24s %12llu %10.3f %10.3f %13.5f %13.5f\n", sites[i].name, sites[i].bytes,
+            (double)sites[i].counts[STATELY_CYCLES] / bytes, (double)sites[i].counts[STATELY_INSTRUCTIONS] / bytes,
+            (double)sites[i].counts[STATELY_CACHE_MISSES] / bytes, (double)sites[i].counts[STATELY_BRANCH_MISSES] / bytes);
+    }
+}
+#else
+#include <stdio.h>
+
+// Profiling is off: no counters, only the bytes and calls charged to each
+// site are kept, and the report prints nothing, so the instrumentation can
+// stay in
+static inline int stately_counters_open(struct stately_counters *c)
+{
+    c->leader = -1;
+    c->opened = 0;
+    return -1;
+}
+
+static inline void stately_counters_close(struct stately_counters *c)
+{
+    (void)c;
+}
+
+static inline void stately_counters_read(const struct stately_counters *c, unsigned long long values[STATELY_COUNTERS])
+{
+    (void)c;
+    memset(values, 0, STATELY_COUNTERS * sizeof(*values));
+}
+
+static inline void stately_profile_add(const struct stately_counters *c, struct stately_profile *site,
+                                       const unsigned long long start[STATELY_COUNTERS], size_t bytes)
+{
+    (void)c, (void)start;
+    site->bytes += bytes;
+    site->calls++;
+}
+
+# define STATELY_PROFILED(counters, site, bytes, call) do { \
+        call; \
+        stately_profile_add(counters, site, NULL, bytes); \
+    } while (0)
+
+static inline void stately_profile_report(FILE *out, const struct stately_profile *sites, int count)
+{
+    (void)out, (void)sites, (void)count;
+}
+#endif
+
+// Counter `k` per byte at a call site
+static inline double stately_per_byte(const struct stately_profile *site, enum stately_counter k)
+{
+    return site->bytes ? (double)site->counts[k] / (double)site->bytes : 0.0;
+}
+
+#define STATELY_MAGIC "STLY"
+#define STATELY_FORMAT 1
+
+static inline void stately_put32(unsigned char *p, unsigned long value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+static inline unsigned long stately_get32(const unsigned char *p)
+{
+    return (unsigned long)p[0] | (unsigned long)p[1] << 8 | (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+// Writes a compiled machine (its table, classifier, start state and
+// accepting states) into `buf` in a portable little-endian format, so a
+// tool can load it without being built with the machine. Only the states
+// and classes in use are stored. Returns the number of bytes the machine
+// takes; if that is more than `capacity`, nothing is written (so call it
+// with a capacity of 0 first to size the buffer).
+static inline size_t stately_save(const struct compiled_machine *cm, void *buf, size_t capacity)
+{
+    int states = stately_state_count(cm->machine), classes = stately_class_count(&cm->classifier);
+    unsigned char *p = (unsigned char *)buf;
+
+    if (cm->start >= states) {
+        states = cm->start + 1;
+    }
+    size_t size = 20 + (size_t)states + 256 + 4 * (size_t)states * (size_t)classes;
+    if (size > capacity) {
+        return size;
+    }
+    memcpy(p, STATELY_MAGIC, 4);
+    stately_put32(p + 4, STATELY_FORMAT);
+    stately_put32(p + 8, (unsigned long)states);
+    stately_put32(p + 12, (unsigned long)classes);
+    stately_put32(p + 16, (unsigned long)cm->start);
+    p += 20;
+    memcpy(p, cm->accepting, (size_t)states);
+    p += states;
+    memcpy(p, cm->classifier.classes, 256);
+    p += 256;
+    for (int s = 0; s < states; s++) {
+        for (int c = 0; c < classes; c++, p += 4) {
+            stately_put32(p, (unsigned long)cm->machine->state_table[s][c]);
+        }
+    }
+    return size;
+}
+
+// Reads a machine written by stately_save() into `table` (whose map() is
+// left NULL, since only bytes through the classifier can be fed to it) and
+// compiles it into `cm`. Returns -1 if `buf` isn't a machine this build can
+// hold.
+static inline int stately_load(struct compiled_machine *cm, struct state_machine *table, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    struct byte_classifier cls;
+
+    if (len < 20 || memcmp(p, STATELY_MAGIC, 4) || stately_get32(p + 4) != STATELY_FORMAT) {
+        return -1;
+    }
+    unsigned long states = stately_get32(p + 8), classes = stately_get32(p + 12), start = stately_get32(p + 16);
+    if (!states || states > MAX_STATES || !classes || classes > MAX_ALPHABET_SIZE + 1 || classes > 256 || start >= states ||
+        len != 20 + states + 256 + 4 * states * classes) {
+        return -1;
+    }
+    p += 20;
+
+    memset(table, 0, sizeof(*table));
+    memset(&cls, 0, sizeof(cls));
+    for (int b = 0; b < 256; b++) {
+        unsigned char c = p[states + (unsigned long)b];
+        if (c >= classes) {
+            return -1;
+        }
+        cls.classes[b] = c;
+        if (c) {
+            cls.rows |= (unsigned short)(1u << (b >> 4));
+        }
+    }
+    const unsigned char *row = p + states + 256;
+    for (unsigned long s = 0; s < states; s++) {
+        for (unsigned long c = 0; c < classes; c++, row += 4) {
+            unsigned long next = stately_get32(row);
+            if (next >= states) {
+                return -1;
+            }
+            table->state_table[s][c] = (int)next;
+        }
+    }
+    table->curr_state = (int)start;
+    (void)stately_compile(cm, table, &cls);
+    for (unsigned long s = 0; s < states; s++) {
+        cm->accepting[s] = p[s] != 0;
+    }
+    return 0;
+}
+
+#define STATELY_SNAPSHOT_MAGIC "STPS"
+#define STATELY_SNAPSHOT_FORMAT 1
+#define STATELY_SNAPSHOT_HEADER 28
+
+// FNV-1a, continuing from `hash` (start from 2166136261)
+static inline unsigned long stately_fnv1a(unsigned long hash, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash = ((hash ^ p[i]) * 16777619ul) & 0xfffffffful;
+    }
+    return hash;
+}
+
+// Hash of the machine's transitions over the states in use, so a snapshot
+// can't be restored into a pool running a different machine
+static inline unsigned long stately_fingerprint(const struct state_machine *machine)
+{
+    int states = stately_state_count(machine);
+    unsigned char bytes[4];
+    unsigned long hash = 2166136261ul;
+
+    stately_put32(bytes, (unsigned long)states);
+    hash = stately_fnv1a(hash, bytes, 4);
+    for (int s = 0; s < states; s++) {
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            stately_put32(bytes, (unsigned long)machine->state_table[s][c]);
+            hash = stately_fnv1a(hash, bytes, 4);
+        }
+    }
+    return hash;
+}
+
+// Bits needed to hold every state below `states`
+static inline int stately_state_bits(int states)
+{
+    int bits = 1;
+    while (bits < 31 && (1 << bits) < states) {
+        bits++;
+    }
+    return bits;
+}
+
+// Writes the states of every entity in the pool into `buf`, packed into as
+// many bits each as the highest state needs, after a header holding the
+// machine's fingerprint, the entity count and a checksum of the packed
+// states. Returns the number of bytes the snapshot takes; if that is more
+// than `capacity`, nothing is written.
+static inline size_t stately_pool_snapshot(const struct state_pool *pool, void *buf, size_t capacity)
+{
+    int states = stately_state_count(pool->machine);
+    unsigned char *p = (unsigned char *)buf;
+
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->states[i] >= states) {
+            states = pool->states[i] + 1;
+        }
+    }
+    int bits = stately_state_bits(states);
+    size_t packed = (pool->count * (size_t)bits + 7) / 8;
+    size_t size = STATELY_SNAPSHOT_HEADER + packed;
+    if (size > capacity) {
+        return size;
+    }
+
+    unsigned char *data = p + STATELY_SNAPSHOT_HEADER;
+    unsigned long long bitbuf = 0;
+    int pending = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        bitbuf |= (unsigned long long)pool->states[i] << pending;
+        for (pending += bits; pending >= 8; pending -= 8) {
+            *data++ = (unsigned char)bitbuf;
+            bitbuf >>= 8;
+        }
+    }
+    if (pending) {
+        *data = (unsigned char)bitbuf;
+    }
+
+    memcpy(p, STATELY_SNAPSHOT_MAGIC, 4);
+    stately_put32(p + 4, STATELY_SNAPSHOT_FORMAT);
+    stately_put32(p + 8, stately_fingerprint(pool->machine));
+    stately_put32(p + 12, (unsigned long)bits);
+    stately_put32(p + 16, (unsigned long)(pool->count & 0xfffffffful));
+    stately_put32(p + 20, (unsigned long)((unsigned long long)pool->count >> 32));
+    stately_put32(p + 24, stately_fnv1a(2166136261ul, p + STATELY_SNAPSHOT_HEADER, packed));
+    return size;
+}
+
+// Reads a snapshot written by stately_pool_snapshot() back into the pool's
+// states (`buf` can be a file mapped or read in one go). Returns -1, with
+// the states untouched, if the snapshot is damaged or was taken from a pool
+// with a different machine or entity count.
+static inline int stately_pool_restore(struct state_pool *pool, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    if (len < STATELY_SNAPSHOT_HEADER || memcmp(p, STATELY_SNAPSHOT_MAGIC, 4) ||
+        stately_get32(p + 4) != STATELY_SNAPSHOT_FORMAT || stately_get32(p + 8) != stately_fingerprint(pool->machine)) {
+        return -1;
+    }
+    unsigned long bits = stately_get32(p + 12);
+    unsigned long long count = stately_get32(p + 16) | (unsigned long long)stately_get32(p + 20) << 32;
+    if (!bits || bits > 31 || (1ul << (bits - 1)) >= MAX_STATES || count != pool->count) {
+        return -1;
+    }
+    size_t packed = (pool->count * (size_t)bits + 7) / 8;
+    if (len != STATELY_SNAPSHOT_HEADER + packed ||
+        stately_get32(p + 24) != stately_fnv1a(2166136261ul, p + STATELY_SNAPSHOT_HEADER, packed)) {
+        return -1;
+    }
+
+    const unsigned char *data = p + STATELY_SNAPSHOT_HEADER;
+    unsigned long long bitbuf = 0, mask = (1ull << bits) - 1;
+    int available = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        for (; available < (int)bits; available += 8) {
+            bitbuf |= (unsigned long long)*data++ << available;
+        }
+        int state = (int)(bitbuf & mask);
+        pool->states[i] = state < MAX_STATES ? state : 0;
+        bitbuf >>= bits;
+        available -= (int)bits;
+    }
+    return 0;
+}
+
+// A machine that also emits a symbol on each transition: output_table has
+// the same shape as state_table, and an output of 0 means the transition
+// emits nothing. The fields before output_table are those of struct
+// state_machine, in the same order, so SET_STATE(), GET_STATE() and
+// GET_NEXT_STATE() work on it as they are.
+struct mealy_machine {
+    int curr_state;
+    int (*map)(const void *);
+    void (*map_batch)(const void *, size_t, size_t, int *);
     int state_table[MAX_STATES][MAX_ALPHABET_SIZE + 1];
+    int output_table[MAX_STATES][MAX_ALPHABET_SIZE + 1];
 };
 
+// Takes the transition for `symbol`, storing what it emits (0 for nothing)
+// in *output, and returns the new state
+static inline int stately_mealy_step(struct mealy_machine *machine, int symbol, int *output)
+{
+    *output = machine->output_table[machine->curr_state][symbol];
+    return machine->curr_state = machine->state_table[machine->curr_state][symbol];
+}
+
+// Feeds `count` inputs of `size` bytes each to the machine (like qsort's
+// base/nmemb/size), appending what it emits to `outputs`, which needs room
+// for `count` symbols. Returns the number of symbols emitted.
+static inline size_t stately_mealy_run(struct mealy_machine *machine, const void *inputs, size_t size, size_t count, int *outputs)
+{
+    const char *p = (const char *)inputs;
+    size_t emitted = 0;
+    for (size_t i = 0; i < count; i++, p += size) {
+        int output;
+        (void)stately_mealy_step(machine, machine->map(p), &output);
+        if (output) {
+            outputs[emitted++] = output;
+        }
+    }
+    return emitted;
+}
+
+// Builds one machine that does what feeding everything `a` emits into `b`
+// does, so chained stages run in one pass with no stream in between. `a`'s
+// output symbols are `b`'s input symbols. Each state of the result is a
+// pair of states of `a` and `b` (pair_of[state] gives them back), only
+// pairs reachable from the current states are built, and a TRAP in either
+// stage is TRAP in the result. The result reads `a`'s inputs with `a`'s
+// map() and emits `b`'s outputs. Returns the number of states, or -1 if
+// more than MAX_STATES pairs are reachable or out of memory.
+static inline int stately_compose(struct mealy_machine *out, int pair_of[MAX_STATES][2],
+                                  const struct mealy_machine *a, const struct mealy_machine *b)
+{
+    int *id = (int *)calloc((size_t)MAX_STATES * MAX_STATES, sizeof(*id));
+    int states = 1, result = -1;
+
+    if (!id) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    out->map = a->map;
+    pair_of[0][0] = pair_of[0][1] = 0;
+    if (!a->curr_state || !b->curr_state) {
+        result = 1;
+        goto done;
+    }
+    pair_of[1][0] = a->curr_state;
+    pair_of[1][1] = b->curr_state;
+    id[a->curr_state * MAX_STATES + b->curr_state] = 1;
+    out->curr_state = 1;
+    states = 2;
+
+    // Breadth first, so the new states come out numbered in that order
+    for (int s = 1; s < states; s++) {
+        int sa = pair_of[s][0], sb = pair_of[s][1];
+        for (int c = 0; c <= MAX_ALPHABET_SIZE; c++) {
+            int na = a->state_table[sa][c], emitted = a->output_table[sa][c], nb = sb, output = 0;
+            if (!na) {
+                continue;
+            }
+            if (emitted) {
+                nb = b->state_table[sb][emitted];
+                output = b->output_table[sb][emitted];
+                if (!nb) {
+                    continue;
+                }
+            }
+            int *next = &id[na * MAX_STATES + nb];
+            if (!*next) {
+                if (states == MAX_STATES) {
+                    goto done;
+                }
+                pair_of[states][0] = na;
+                pair_of[states][1] = nb;
+                *next = states++;
+            }
+            out->state_table[s][c] = *next;
+            out->output_table[s][c] = output;
+        }
+    }
+    result = states;
+
+done:
+    free(id);
+    return result;
+}
+
+#ifndef STATELY_MAX_DISTRIBUTIONS
+# define STATELY_MAX_DISTRIBUTIONS 64
+#endif
+
+#ifndef STATELY_MAX_OUTCOMES
+# define STATELY_MAX_OUTCOMES 16
+#endif
+
+// In a state_table, a transition to STOCHASTIC(n) goes to a state drawn
+// from distribution n. These are negative (and below EXPLICIT_TRAP), so
+// they never clash with real states.
+#define STOCHASTIC(n) (-2 - (n))
+#define IS_STOCHASTIC(state) ((state) < -1)
+
+// `count` target states and their relative weights
+struct stately_distribution {
+    int count;
+    int to[STATELY_MAX_OUTCOMES];
+    double weight[STATELY_MAX_OUTCOMES];
+};
+
+// One column of a Walker alias table: stay on `stay` if the draw is below
+// `threshold`, otherwise go to `alias`
+struct alias_slot {
+    unsigned int threshold;
+    int stay;
+    int alias;
+    int unused;
+};
+
+// Every distribution as an alias table with one slot per outcome, so a
+// draw picks a slot and then one of its two states
+struct stochastic_table {
+    struct alias_slot slots[STATELY_MAX_DISTRIBUTIONS][STATELY_MAX_OUTCOMES];
+    int count[STATELY_MAX_DISTRIBUTIONS];
+};
+
+// splitmix64: one 64-bit add per draw, and stream i + k can be computed
+// without stepping through the draws in between. Give each thread its own.
+struct stately_rng {
+    unsigned long long state;
+};
+
+#define STATELY_GOLDEN 0x9e3779b97f4a7c15ull
+
+static inline unsigned long long stately_mix64(unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline unsigned long long stately_rng_next(struct stately_rng *rng)
+{
+    return stately_mix64(rng->state += STATELY_GOLDEN);
+}
+
+// Builds the alias tables (Vose's method) for distributions [0, count).
+// Fails if there are too many distributions, a distribution has no
+// outcomes or too many, or its weights are negative or add up to 0.
+static inline int stately_stochastic_init(struct stochastic_table *st, const struct stately_distribution *distributions, int count)
+{
+    memset(st, 0, sizeof(*st));
+    if (count < 0 || count > STATELY_MAX_DISTRIBUTIONS) {
+        return -1;
+    }
+    for (int d = 0; d < count; d++) {
+        const struct stately_distribution *dist = &distributions[d];
+        double scaled[STATELY_MAX_OUTCOMES], total = 0;
+        int small[STATELY_MAX_OUTCOMES], large[STATELY_MAX_OUTCOMES], n = dist->count, smalls = 0, larges = 0;
+
+        if (n <= 0 || n > STATELY_MAX_OUTCOMES) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (dist->weight[i] < 0) {
+                return -1;
+            }
+            total += dist->weight[i];
+        }
+        if (total <= 0) {
+            return -1;
+        }
+
+        // Average slot is 1: short slots get topped up from long ones
+        for (int i = 0; i < n; i++) {
+            scaled[i] = dist->weight[i] * n / total;
+            if (scaled[i] < 1) {
+                small[smalls++] = i;
+            } else {
+                large[larges++] = i;
+            }
+        }
+        while (smalls && larges) {
+            int s = small[--smalls], l = large[larges - 1];
+            st->slots[d][s].threshold = (unsigned int)(scaled[s] * 4294967296.0);
+            st->slots[d][s].stay = dist->to[s];
+            st->slots[d][s].alias = dist->to[l];
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                larges--;
+                small[smalls++] = l;
+            }
+        }
+
+        // Whatever is left is full (give or take rounding)
+        while (larges) {
+            int l = large[--larges];
+            st->slots[d][l].threshold = 0xffffffffu;
+            st->slots[d][l].stay = st->slots[d][l].alias = dist->to[l];
+        }
+        while (smalls) {
+            int s = small[--smalls];
+            st->slots[d][s].threshold = 0xffffffffu;
+            st->slots[d][s].stay = st->slots[d][s].alias = dist->to[s];
+        }
+        st->count[d] = n;
+    }
+    return 0;
+}
+
+// Turns a STOCHASTIC() transition into a state using one 64-bit draw: the
+// high half picks the slot and the low half picks within it. Anything
+// else is returned as it is.
+static inline int stately_resolve(const struct stochastic_table *st, int next, unsigned long long draw)
+{
+    if (!IS_STOCHASTIC(next)) {
+        return next;
+    }
+    int d = -2 - next;
+    const struct alias_slot *slot = &st->slots[d][((draw >> 32) * (unsigned long long)st->count[d]) >> 32];
+    return (unsigned int)draw < slot->threshold ? slot->stay : slot->alias;
+}
+
+// GET_NEXT_STATE() for a machine with STOCHASTIC() transitions
+static inline int stately_stochastic_next(struct state_machine *machine, const struct stochastic_table *st,
+                                          const void *input, struct stately_rng *rng)
+{
+    int next = machine->state_table[machine->curr_state][machine->map(input)];
+    if (IS_STOCHASTIC(next)) {
+        next = stately_resolve(st, next, stately_rng_next(rng));
+    }
+    return machine->curr_state = next;
+}
+
+// stately_step_states() for a machine with STOCHASTIC() transitions. The
+// table lookups go through the usual (gathering) batch step, then entity i
+// resolves its transition with draw i of the stream, so the second loop
+// has no dependency between entities either. The stream moves on by
+// `count` draws.
+static inline void stately_step_stochastic(const struct state_machine *machine, const struct stochastic_table *st,
+                                           int *states, const int *symbols, size_t count, struct stately_rng *rng)
+{
+    unsigned long long base = rng->state;
+    stately_step_states(machine, states, symbols, count);
+    for (size_t i = 0; i < count; i++) {
+        if (IS_STOCHASTIC(states[i])) {
+            states[i] = stately_resolve(st, states[i], stately_mix64(base + (i + 1) * STATELY_GOLDEN));
+        }
+    }
+    rng->state = base + count * STATELY_GOLDEN;
+}
+
+// stately_step_all() for a machine with STOCHASTIC() transitions
+static inline void stately_step_all_stochastic(struct state_pool *pool, const struct stochastic_table *st,
+                                               const int *symbols, struct stately_rng *rng)
+{
+    stately_step_stochastic(pool->machine, st, pool->states, symbols, pool->count, rng);
+}
+
+#if defined(STATELY_NUMA) && defined(STATELY_THREADS)
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef STATELY_MAX_NODES
+# define STATELY_MAX_NODES 8
+#endif
+
+// The NUMA node the calling thread is running on (0 if the kernel can't say)
+static inline int stately_current_node(void)
+{
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) || node >= STATELY_MAX_NODES) {
+        return 0;
+    }
+    return (int)node;
+}
+
+// Reads the CPUs of `node` from sysfs into `cpus`. Returns -1 if there is
+// no such node.
+static inline int stately_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64];
+    int lo, hi, n, c;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return -1;
+    }
+    CPU_ZERO(cpus);
+    while ((n = fscanf(in, "%d", &lo)) == 1) {
+        hi = lo;
+        c = fgetc(in);
+        if (c == '-') {
+            if (fscanf(in, "%d", &hi) != 1) {
+                break;
+            }
+            c = fgetc(in);
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+// Number of NUMA nodes (1 on machines without any, or without sysfs)
+static inline int stately_node_count(void)
+{
+    cpu_set_t cpus;
+    int nodes = 0;
+    while (nodes < STATELY_MAX_NODES && !stately_node_cpus(nodes, &cpus)) {
+        nodes++;
+    }
+    return nodes ? nodes : 1;
+}
+
+// Restricts the calling thread to the CPUs of `node`
+static inline int stately_pin_to_node(int node)
+{
+    cpu_set_t cpus;
+    if (stately_node_cpus(node, &cpus)) {
+        return -1;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) ? -1 : 0;
+}
+
+// A worker job that pins worker `index` of `count` to a node, giving each
+// node a contiguous run of workers. Since stately_split() hands out
+// contiguous slices by index, neighbouring slices of a pool stay on one
+// node. Worker 0 is the calling thread, which gets pinned too.
+static inline void stately_pin_job(void *ctx, int index, int count)
+{
+    int nodes = stately_node_count();
+    (void)ctx;
+    (void)stately_pin_to_node(index * nodes / count);
+}
+
+static inline void stately_workers_pin(struct stately_workers *w)
+{
+    stately_workers_run(w, stately_pin_job, NULL);
+}
+
+// A compiled machine and its table, copied onto one node
+struct stately_replica {
+    struct state_machine table;
+    struct compiled_machine compiled;
+};
+
+// A compiled machine with a copy per NUMA node, made on first use by a
+// thread on that node so that its pages are local (the kernel's default
+// first-touch policy places them there)
+struct numa_machine {
+    const struct compiled_machine *master;
+    struct stately_replica *replicas[STATELY_MAX_NODES];
+};
+
+static inline void stately_numa_init(struct numa_machine *nm, const struct compiled_machine *master)
+{
+    memset(nm, 0, sizeof(*nm));
+    nm->master = master;
+}
+
+// The replica for the calling thread's node, made now if it doesn't exist
+// yet. Threads on the same node racing to make it agree on one. Returns
+// NULL if out of memory.
+static inline const struct stately_replica *stately_local(struct numa_machine *nm)
+{
+    int node = stately_current_node();
+    struct stately_replica *replica = __atomic_load_n(&nm->replicas[node], __ATOMIC_ACQUIRE), *expected = NULL;
+    if (replica) {
+        return replica;
+    }
+
+    // Written (so placed) by this thread, on this node
+    replica = (struct stately_replica *)malloc(sizeof(*replica));
+    if (!replica) {
+        return NULL;
+    }
+    memcpy(&replica->table, nm->master->machine, sizeof(replica->table));
+    memcpy(&replica->compiled, nm->master, sizeof(replica->compiled));
+    replica->compiled.machine = &replica->table;
+
+    if (!__atomic_compare_exchange_n(&nm->replicas[node], &expected, replica, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(replica);
+        return expected;
+    }
+    return replica;
+}
+
+static inline void stately_numa_free(struct numa_machine *nm)
+{
+    for (int node = 0; node < STATELY_MAX_NODES; node++) {
+        free(nm->replicas[node]);
+        nm->replicas[node] = NULL;
+    }
+}
+
+struct stately_numa_step_job {
+    struct state_pool *pool;
+    struct numa_machine *nm;
+    const int *symbols;
+};
+
+static inline void stately_numa_step_slice(void *ctx, int index, int count)
+{
+    struct stately_numa_step_job *job = (struct stately_numa_step_job *)ctx;
+    const struct stately_replica *replica = stately_local(job->nm);
+    size_t begin, end;
+    stately_split(job->pool->count, index, count, &begin, &end);
+    stately_step_states(replica ? &replica->table : job->pool->machine, job->pool->states + begin, job->symbols + begin, end - begin);
+}
+
+// stately_step_all_parallel() with every worker stepping through its own
+// node's copy of the table (best after stately_workers_pin())
+static inline void stately_step_all_numa(struct state_pool *pool, struct numa_machine *nm, const int *symbols, struct stately_workers *w)
+{
+    struct stately_numa_step_job job = { pool, nm, symbols };
+    stately_workers_run(w, stately_numa_step_slice, &job);
+}
+#endif
+
+// Generates step and run functions specialized for one machine:
+//
+//     static struct state_machine machine = { ... };
+//     STATELY_DEFINE_MACHINE(date, map_chr, machine.state_table)
+//
+// defines date_step(state, input), date_run(state, inputs, size, count)
+// and date_run_string(state, string). They call `mapper` directly instead
+// of through the map pointer and index `table` by name, so the compiler can
+// inline the mapper, fold the table's address into the loads and unroll the
+// loop. `table` must be visible at file scope (a static machine's
+// state_table, or a table of its own), and if it is const the compiler may
+// fold the transitions themselves too.
+#define STATELY_DEFINE_MACHINE(name, mapper, table) \
+    static inline int name##_step(int state, const void *input) \
+    { \
+        return (table)[state][mapper(input)]; \
+    } \
+    \
+    static inline int name##_run(int state, const void *inputs, size_t size, size_t count) \
+    { \
+        const char *p = (const char *)inputs; \
+        for (size_t i = 0; i < count; i++, p += size) { \
+            state = (table)[state][mapper(p)]; \
+        } \
+        return state; \
+    } \
+    \
+    static inline int name##_run_string(int state, const char *input) \
+    { \
+        for (; *input; input++) { \
+            state = (table)[state][mapper(input)]; \
+        } \
+        return state; \
+    }
+
+// Match outputs of a keyword machine, one list per state in compressed
+// rows: the keywords recognized on entering state s are
+// ids[first[s]] .. ids[first[s + 1] - 1], longest first
+struct keyword_outputs {
+    int states;
+    int *first;
+    int *ids;
+    size_t *lengths;
+};
+
+static inline void stately_keywords_free(struct keyword_outputs *out)
+{
+    free(out->first);
+    free(out->ids);
+    free(out->lengths);
+    out->first = out->ids = NULL;
+    out->lengths = NULL;
+}
+
+// Builds the Aho-Corasick automaton of `count` NUL-terminated keywords into
+// `machine`, with every failure link resolved into a plain transition, and
+// compiles it into `cm` with the bytes the keywords use as its classes. State
+// 1 is the start, no transition leads to TRAP, and the states where a keyword
+// ends are accepting, with their keywords (by index) listed in `out`. Returns
+// the number of states, or -1 if a keyword is empty or the machine needs more
+// than MAX_STATES states or MAX_ALPHABET_SIZE classes.
+static inline int stately_keywords_init(struct compiled_machine *cm, struct state_machine *machine, struct keyword_outputs *out,
+                                        const char *const *keywords, size_t count)
+{
+    struct byte_classifier cls;
+    int classes = 1, states = 2, head = 0, tail = 0;
+    int *total;
+
+    memset(&cls, 0, sizeof(cls));
+    memset(machine, 0, sizeof(*machine));
+    memset(out, 0, sizeof(*out));
+    for (size_t k = 0; k < count; k++) {
+        const unsigned char *p = (const unsigned char *)keywords[k];
+        if (!*p) {
+            return -1;
+        }
+        for (; *p; p++) {
+            if (!cls.classes[*p]) {
+                if (classes > MAX_ALPHABET_SIZE) {
+                    return -1;
+                }
+                cls.classes[*p] = (unsigned char)classes++;
+                cls.rows |= (unsigned short)(1u << (*p >> 4));
+            }
+        }
+    }
+
+    int *failure = (int *)malloc(MAX_STATES * sizeof(*failure));
+    int *order = (int *)malloc(MAX_STATES * sizeof(*order));
+    int *own = (int *)calloc(MAX_STATES, sizeof(*own));
+    int *next_keyword = (int *)malloc((count ? count : 1) * sizeof(*next_keyword));
+    int *ending = (int *)malloc(MAX_STATES * sizeof(*ending));
+    out->first = (int *)calloc(MAX_STATES + 1, sizeof(*out->first));
+    out->lengths = (size_t *)malloc((count ? count : 1) * sizeof(*out->lengths));
+    if (!failure || !order || !own || !next_keyword || !ending || !out->first || !out->lengths) {
+        goto fail;
+    }
+    for (int s = 0; s < MAX_STATES; s++) {
+        ending[s] = -1;
+    }
+
+    // The trie, with 0 for a missing edge (nothing goes back to TRAP or the root)
+    for (size_t k = 0; k < count; k++) {
+        const unsigned char *p = (const unsigned char *)keywords[k];
+        int state = 1;
+        for (; *p; p++) {
+            int *edge = &machine->state_table[state][cls.classes[*p]];
+            if (!*edge) {
+                if (states == MAX_STATES) {
+                    goto fail;
+                }
+                *edge = states++;
+            }
+            state = *edge;
+        }
+        out->lengths[k] = (size_t)(p - (const unsigned char *)keywords[k]);
+        next_keyword[k] = ending[state];
+        ending[state] = (int)k;
+        own[state]++;
+    }
+
+    // Breadth first, so a state's failure target is finished before it is
+    failure[1] = 1;
+    order[tail++] = 1;
+    while (head < tail) {
+        int u = order[head++];
+        for (int c = 0; c < classes; c++) {
+            int v = machine->state_table[u][c];
+            int resolved = u == 1 ? 1 : machine->state_table[failure[u]][c];
+            if (v) {
+                failure[v] = resolved;
+                order[tail++] = v;
+            } else {
+                machine->state_table[u][c] = resolved;
+            }
+        }
+    }
+
+    // Each state outputs its own keywords, then those of its failure target
+    total = own;
+    for (int i = 1; i < tail; i++) {
+        int s = order[i];
+        total[s] += total[failure[s]];
+    }
+    for (int s = 0; s < states; s++) {
+        out->first[s + 1] = out->first[s] + total[s];
+    }
+    out->ids = (int *)malloc((out->first[states] ? (size_t)out->first[states] : 1) * sizeof(*out->ids));
+    if (!out->ids) {
+        goto fail;
+    }
+    for (int i = 0; i < tail; i++) {
+        int s = order[i], at = out->first[s];
+        for (int k = ending[s]; k >= 0; k = next_keyword[k]) {
+            out->ids[at++] = k;
+        }
+        if (s != 1) {
+            memcpy(out->ids + at, out->ids + out->first[failure[s]], (size_t)total[failure[s]] * sizeof(*out->ids));
+        }
+    }
+    out->states = states;
+
+    machine->curr_state = 1;
+    (void)stately_compile(cm, machine, &cls);
+    for (int s = 0; s < states; s++) {
+        cm->accepting[s] = total[s] > 0;
+    }
+
+    free(failure);
+    free(order);
+    free(own);
+    free(next_keyword);
+    free(ending);
+    return states;
+
+fail:
+    free(failure);
+    free(order);
+    free(own);
+    free(next_keyword);
+    free(ending);
+    stately_keywords_free(out);
+    return -1;
+}
+
+// Reports every occurrence of every keyword in `bytes` to on_keyword() as
+// the keyword's index and its [start, end) offsets, in order of end (longest
+// first for the same end), overlapping ones included. One table lookup per
+// byte whatever the number of keywords, and runs of bytes that can't start
+// a keyword are skipped with stately_ranges_span(). on_keyword() may be
+// NULL, or return nonzero to stop. Returns the number of occurrences.
+static inline size_t stately_keywords_scan(const struct compiled_machine *cm, const struct keyword_outputs *out,
+                                           const void *bytes, size_t len,
+                                           int (*on_keyword)(int, size_t, size_t, void *), void *ctx)
+{
+    unsigned char symbols[STATELY_BATCH_SIZE];
+    const unsigned char *p = (const unsigned char *)bytes;
+    const struct state_machine *machine = cm->machine;
+    int state = cm->start;
+    size_t i = 0, matches = 0;
+    while (i < len) {
+        size_t n = len - i < STATELY_BATCH_SIZE ? len - i : STATELY_BATCH_SIZE;
+        size_t j = 0;
+        stately_classify(&cm->classifier, p + i, n, symbols);
+        while (j < n) {
+            if (cm->loops[state].count && !cm->accepting[state]) {
+                j += stately_ranges_span(&cm->loops[state], p + i + j, len - i - j);
+                if (j >= n) {
+                    break;
+                }
+            }
+            state = machine->state_table[state][symbols[j++]];
+            if (!cm->accepting[state]) {
+                continue;
+            }
+            size_t end = i + j;
+            for (int k = out->first[state]; k < out->first[state + 1]; k++) {
+                int id = out->ids[k];
+                matches++;
+                if (on_keyword && on_keyword(id, end - out->lengths[id], end, ctx)) {
+                    return matches;
+                }
+            }
+        }
+        i += j;
+    }
+    return matches;
+}
+
 #endif
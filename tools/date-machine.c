@@ -0,0 +1,151 @@
+#include <stdio.h>
+
+#include "stately.h"
+
+enum input { INVALID, ZERO, ONE, TWO, THREE, FOUR_TO_NINE, HYPHEN };
+
+enum state {
+    TRAP,                  // ([12]\d{3}-(0[1-9]|1[0-2])-(0[1-9]|[12]\d|3[01]))
+    FIRST_DIGIT,           //  [12]
+    SECOND_DIGIT,          //      \d
+    THIRD_DIGIT,           //        \d
+    FOURTH_DIGIT,          //          \d
+    FIRST_HYPHEN,          //            -
+    MONTH,                 //             (0     |1     )
+    MONTH_AFTER_ZERO,      //             ( [1-9]|      )
+    MONTH_AFTER_ONE,       //             (      | [0-2])
+    SECOND_HYPHEN,         //                           -
+    DAY,                   //                            (0     |[12]  |3     )
+    DAY_AFTER_ZERO,        //                            ( [1-9]|      |      )
+    DAY_AFTER_ONE_OR_TWO,  //                            (      |    \d|      )
+    DAY_AFTER_THREE,       //                            (      |      | [01] )
+    ACCEPT,
+};
+
+static const struct byte_classifier classifier = {
+    .classes = {
+        ['0'] = ZERO, ['1'] = ONE, ['2'] = TWO, ['3'] = THREE,
+        ['4'] = FOUR_TO_NINE, ['5'] = FOUR_TO_NINE, ['6'] = FOUR_TO_NINE,
+        ['7'] = FOUR_TO_NINE, ['8'] = FOUR_TO_NINE, ['9'] = FOUR_TO_NINE,
+        ['-'] = HYPHEN,
+    },
+    .rows = 1u << ('0' >> 4) | 1u << ('-' >> 4),
+};
+
+static struct state_machine machine = {
+
+    // Start state
+    .curr_state = FIRST_DIGIT,
+
+    // States
+    .state_table = {
+
+        [FIRST_DIGIT] = {
+            [ONE] = SECOND_DIGIT,
+            [TWO] = SECOND_DIGIT,
+        },
+
+        [SECOND_DIGIT] = {
+            [ZERO]         = THIRD_DIGIT,
+            [ONE]          = THIRD_DIGIT,
+            [TWO]          = THIRD_DIGIT,
+            [THREE]        = THIRD_DIGIT,
+            [FOUR_TO_NINE] = THIRD_DIGIT,
+        },
+
+        [THIRD_DIGIT] = {
+            [ZERO]         = FOURTH_DIGIT,
+            [ONE]          = FOURTH_DIGIT,
+            [TWO]          = FOURTH_DIGIT,
+            [THREE]        = FOURTH_DIGIT,
+            [FOUR_TO_NINE] = FOURTH_DIGIT,
+        },
+
+        [FOURTH_DIGIT] = {
+            [ZERO]         = FIRST_HYPHEN,
+            [ONE]          = FIRST_HYPHEN,
+            [TWO]          = FIRST_HYPHEN,
+            [THREE]        = FIRST_HYPHEN,
+            [FOUR_TO_NINE] = FIRST_HYPHEN,
+        },
+
+        [FIRST_HYPHEN] = {
+            [HYPHEN] = MONTH,
+        },
+
+        [MONTH] = {
+            [ZERO] = MONTH_AFTER_ZERO,
+            [ONE]  = MONTH_AFTER_ONE,
+        },
+
+        [MONTH_AFTER_ZERO] = {
+            [ONE]          = SECOND_HYPHEN,
+            [TWO]          = SECOND_HYPHEN,
+            [THREE]        = SECOND_HYPHEN,
+            [FOUR_TO_NINE] = SECOND_HYPHEN,
+        },
+
+        [MONTH_AFTER_ONE] = {
+            [ZERO] = SECOND_HYPHEN,
+            [ONE]  = SECOND_HYPHEN,
+            [TWO]  = SECOND_HYPHEN,
+        },
+
+        [SECOND_HYPHEN] = {
+            [HYPHEN] = DAY,
+        },
+
+        [DAY] = {
+            [ZERO]  = DAY_AFTER_ZERO,
+            [ONE]   = DAY_AFTER_ONE_OR_TWO,
+            [TWO]   = DAY_AFTER_ONE_OR_TWO,
+            [THREE] = DAY_AFTER_THREE,
+        },
+
+        [DAY_AFTER_ZERO] = {
+            [ONE]          = ACCEPT,
+            [TWO]          = ACCEPT,
+            [THREE]        = ACCEPT,
+            [FOUR_TO_NINE] = ACCEPT,
+        },
+
+        [DAY_AFTER_ONE_OR_TWO] = {
+            [ZERO]         = ACCEPT,
+            [ONE]          = ACCEPT,
+            [TWO]          = ACCEPT,
+            [THREE]        = ACCEPT,
+            [FOUR_TO_NINE] = ACCEPT,
+        },
+
+        [DAY_AFTER_THREE] = {
+            [ZERO] = ACCEPT,
+            [ONE]  = ACCEPT,
+        },
+
+    }
+
+};
+
+// Writes the YYYY-MM-dd machine from examples/date_validator.c, with the
+// digits grouped into classes, for stately-scan to load
+int main(int argc, char **argv)
+{
+    static unsigned char buf[65536];
+    struct compiled_machine compiled;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s OUTPUT\n", argv[0]);
+        return 2;
+    }
+
+    (void)stately_compile(&compiled, &machine, &classifier);
+    stately_accept(&compiled, ACCEPT);
+
+    size_t size = stately_save(&compiled, buf, sizeof(buf));
+    FILE *out = fopen(argv[1], "wb");
+    if (!out || size > sizeof(buf) || fwrite(buf, 1, size, out) != size || fclose(out)) {
+        perror(argv[1]);
+        return 1;
+    }
+    return 0;
+}
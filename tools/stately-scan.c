@@ -0,0 +1,291 @@
+// mmap(), pread() and posix_fadvise() need more than -std=c99 gives us
+#define _DEFAULT_SOURCE
+#define STATELY_THREADS
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stately.h"
+
+#define CHUNK_SIZE (1 << 20)
+
+struct options {
+    int threads;
+    size_t max_offsets;
+    int use_pread;
+    const char *machine;
+    const char *input;
+};
+
+// What one worker found in its part of the file
+struct part {
+    off_t begin;
+    off_t end;
+    unsigned long long accepted;
+    unsigned long long rejected;
+    off_t *offsets;
+    size_t offset_count;
+    int error;
+};
+
+struct scan {
+    const struct compiled_machine *cm;
+    const struct options *options;
+    int fd;
+    const unsigned char *map;
+    struct part parts[STATELY_MAX_THREADS];
+};
+
+static void check_line(const struct scan *scan, struct part *part, const unsigned char *line, size_t len, off_t offset)
+{
+    const struct compiled_machine *cm = scan->cm;
+    if (len && line[len - 1] == '\r') {
+        len--;
+    }
+    if (cm->accepting[stately_scan(cm, cm->start, line, len)]) {
+        part->accepted++;
+        return;
+    }
+    if (part->offset_count < scan->options->max_offsets) {
+        part->offsets[part->offset_count++] = offset;
+    }
+    part->rejected++;
+}
+
+// Checks every line starting in [begin, end) of the mapped file
+static void scan_mapped(const struct scan *scan, struct part *part)
+{
+    const unsigned char *p = scan->map + part->begin, *end = scan->map + part->end;
+    while (p < end) {
+        const unsigned char *newline = memchr(p, '\n', (size_t)(end - p));
+        size_t len = newline ? (size_t)(newline - p) : (size_t)(end - p);
+        check_line(scan, part, p, len, p - scan->map);
+        p += len + 1;
+    }
+}
+
+// Same, reading the file in chunks and asking the kernel to start reading
+// the next chunk while this one is being checked. The buffer grows to fit
+// lines longer than a chunk, so any line mmap() can check, this can too.
+static void scan_pread(const struct scan *scan, struct part *part)
+{
+    size_t capacity = 2 * CHUNK_SIZE, have = 0;
+    unsigned char *buf = malloc(capacity);
+    off_t at = part->begin, line_start = part->begin;
+
+    if (!buf) {
+        part->error = ENOMEM;
+        return;
+    }
+    while (at < part->end) {
+        size_t want = part->end - at < CHUNK_SIZE ? (size_t)(part->end - at) : CHUNK_SIZE;
+        if (have + want > capacity) {
+            unsigned char *more = realloc(buf, 2 * capacity);
+            if (!more) {
+                part->error = ENOMEM;
+                break;
+            }
+            buf = more;
+            capacity *= 2;
+        }
+        ssize_t got = pread(scan->fd, buf + have, want, at);
+        if (got <= 0) {
+            part->error = got ? errno : EIO;
+            break;
+        }
+        at += got;
+        if (at < part->end) {
+            (void)posix_fadvise(scan->fd, at, CHUNK_SIZE, POSIX_FADV_WILLNEED);
+        }
+        have += (size_t)got;
+
+        // Whole lines now, the last partial one carries over
+        size_t done = 0;
+        for (;;) {
+            const unsigned char *newline = memchr(buf + done, '\n', have - done);
+            if (!newline) {
+                break;
+            }
+            size_t len = (size_t)(newline - (buf + done));
+            check_line(scan, part, buf + done, len, line_start);
+            done += len + 1;
+            line_start += (off_t)len + 1;
+        }
+        memmove(buf, buf + done, have - done);
+        have -= done;
+    }
+    if (have && !part->error) {
+        check_line(scan, part, buf, have, line_start);
+    }
+    free(buf);
+}
+
+static void scan_part(void *ctx, int index, int count)
+{
+    struct scan *scan = ctx;
+    (void)count;
+    if (scan->map) {
+        scan_mapped(scan, &scan->parts[index]);
+    } else {
+        scan_pread(scan, &scan->parts[index]);
+    }
+}
+
+// Moves a split point forward to just past the next newline, so every line
+// is checked by exactly one worker
+static off_t line_boundary(const struct scan *scan, off_t at, off_t size)
+{
+    unsigned char byte;
+    if (at == 0) {
+        return 0;
+    }
+    for (at--; at < size; at++) {
+        if (scan->map ? scan->map[at] == '\n' : pread(scan->fd, &byte, 1, at) == 1 && byte == '\n') {
+            return at + 1;
+        }
+    }
+    return size;
+}
+
+static int load_machine(const char *path, struct compiled_machine *cm, struct state_machine *table)
+{
+    static unsigned char buf[4 * MAX_STATES * (MAX_ALPHABET_SIZE + 2) + 1024];
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        return -1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf), in);
+    int failed = ferror(in) || !feof(in);
+    fclose(in);
+    return failed ? -1 : stately_load(cm, table, buf, len);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-t THREADS] [-n OFFSETS] [-p] MACHINE FILE\n"
+        "\n"
+        "Checks every line of FILE against MACHINE (as written by stately_save())\n"
+        "and prints how many were accepted and rejected, and the byte offsets of\n"
+        "the first OFFSETS (default 10) rejected lines. Exits with 1 if any line\n"
+        "was rejected.\n"
+        "\n"
+        "  -t THREADS  split the file across this many threads (default: one per CPU)\n"
+        "  -n OFFSETS  how many rejected line offsets to print\n"
+        "  -p          read with pread() instead of mapping the file\n",
+        name);
+}
+
+int main(int argc, char **argv)
+{
+    static struct state_machine table;
+    static struct scan scan;
+    struct compiled_machine cm;
+    struct options options = { 0, 10, 0, NULL, NULL };
+    struct stately_workers workers;
+    struct stat st;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:ph")) != -1) {
+        switch (opt) {
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'n':
+            options.max_offsets = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            options.use_pread = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    options.machine = argv[optind];
+    options.input = argv[optind + 1];
+    if (options.threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (options.threads > STATELY_MAX_THREADS) {
+        options.threads = STATELY_MAX_THREADS;
+    }
+
+    if (load_machine(options.machine, &cm, &table)) {
+        fprintf(stderr, "%s: not a machine this build can load\n", options.machine);
+        return 2;
+    }
+
+    scan.cm = &cm;
+    scan.options = &options;
+    scan.fd = open(options.input, O_RDONLY);
+    if (scan.fd < 0 || fstat(scan.fd, &st)) {
+        perror(options.input);
+        return 2;
+    }
+
+    if (!options.use_pread && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, scan.fd, 0);
+        if (map != MAP_FAILED) {
+            (void)madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            scan.map = map;
+        }
+    }
+
+    // Small files aren't worth waking threads for
+    if (st.st_size < (off_t)options.threads * CHUNK_SIZE) {
+        options.threads = st.st_size / CHUNK_SIZE + 1 < (off_t)options.threads ? (int)(st.st_size / CHUNK_SIZE + 1) : options.threads;
+    }
+
+    for (int i = 0; i < options.threads; i++) {
+        scan.parts[i].begin = line_boundary(&scan, st.st_size / options.threads * i, st.st_size);
+        scan.parts[i].offsets = malloc((options.max_offsets ? options.max_offsets : 1) * sizeof(off_t));
+        if (!scan.parts[i].offsets) {
+            perror("malloc");
+            return 2;
+        }
+    }
+    for (int i = 0; i < options.threads; i++) {
+        scan.parts[i].end = i + 1 < options.threads ? scan.parts[i + 1].begin : st.st_size;
+    }
+
+    if (stately_workers_start(&workers, options.threads)) {
+        perror("pthread_create");
+        return 2;
+    }
+    stately_workers_run(&workers, scan_part, &scan);
+    stately_workers_stop(&workers);
+
+    // Parts are in file order, so their offsets are too
+    unsigned long long accepted = 0, rejected = 0;
+    size_t printed = 0;
+    for (int i = 0; i < options.threads; i++) {
+        if (scan.parts[i].error) {
+            fprintf(stderr, "%s: %s\n", options.input, strerror(scan.parts[i].error));
+            status = 2;
+        }
+        accepted += scan.parts[i].accepted;
+        rejected += scan.parts[i].rejected;
+        for (size_t j = 0; j < scan.parts[i].offset_count && printed < options.max_offsets; j++, printed++) {
+            printf("rejected line at offset %lld\n", (long long)scan.parts[i].offsets[j]);
+        }
+        free(scan.parts[i].offsets);
+    }
+    printf("accepted %llu\nrejected %llu\n", accepted, rejected);
+
+    if (scan.map) {
+        munmap((void *)scan.map, (size_t)st.st_size);
+    }
+    close(scan.fd);
+    return status ? status : rejected != 0;
+}